@@ -0,0 +1,282 @@
+/*
+ * The ungarbling, serially and as the TBB pipeline, on synthetic frames held
+ * in memory, with no display and no files:
+ *     serial          the four filters one after another, as pipeline_serial
+ *     serial fused    fusedUngarbleFilter() on one thread
+ *     pipeline        pipeline_tbb's stages: source, the four filters, sink
+ *     pipeline fused  the same with the one fused stage (-f)
+ * The frames are made by garbling smooth source frames: the inverse of
+ * each filter, in reverse order (rotate back, shift and rotate the channels
+ * back, undo the contrast and the brightness). Their values stay in the
+ * range the brightness and contrast filters invert exactly.
+ *
+ * Every run takes each frame from memory with a copy, in place of reading
+ * and decoding it, and ends with the -o sum sink's hash of the output. It
+ * reports frames per second and each frame's latency from the copy to the
+ * hash; "differ" counts the frames whose hash is not the serial run's.
+ * The serial output is also compared with the source frames inside the
+ * circle the two rotations keep (the corners turn out of the frame). The
+ * error there comes from interpolating twice and stays within a level or
+ * two. The program exits with 1 if any frame differs or the error is above
+ * MAX_SOURCE_ERROR or MAX_SOURCE_MEAN.
+ *
+ *     ./pipeline_bench [-n tokens] [frames] [WxH ...]
+ */
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <tbb/tbb.h>
+#include <tbb/pipeline.h>
+
+using namespace cv;
+
+#include "pipeline_filters.cpp"
+#include "pipeline_pool.cpp"
+#include "pipeline_stats.cpp"
+#include "pipeline_sinks.cpp"
+#include "pipeline_stages.cpp"
+
+// Largest and mean error against the source frames that still pass, in levels
+static const int MAX_SOURCE_ERROR = 3;
+static const double MAX_SOURCE_MEAN = 0.25;
+
+// Pixels this close to the edge of the kept circle are left out of the comparison
+static const int CIRCLE_MARGIN = 2;
+
+// Source frame i: slow gradients and waves that move from frame to frame, values in [16, 148]
+static void sourceFrame(int rows, int cols, int i, Mat& out)
+{
+    out.create(rows, cols, CV_8UC3);
+    for(int y=0;y<rows;y++) {
+        uchar* p = out.ptr(y);
+        for(int x=0;x<cols;x++) {
+            for(int c=0;c<3;c++) {
+                const double wave = sin((x + 7.0*i) / (23.0 + 9*c)) * cos((y - 5.0*i) / (31.0 + 7*c));
+                const double ramp = (double)(x + y + 40*c) / (rows + cols + 80);
+                p[3*x+c] = (uchar)lrint(16 + 66*ramp + 66*(0.5 + 0.5*wave));
+            }
+        }
+    }
+}
+
+// The garbled frame that the filters turn back into src
+static void garbleFrame(const Mat& src, Mat& out)
+{
+    const int rows = src.rows, cols = src.cols;
+
+    // rotateMatFilter turns by ROTATE_ANGLE-180 degrees, so turn the other way
+    Mat turned;
+    Mat back = getRotationMatrix2D(Point(cols/2, rows/2), -(ROTATE_ANGLE-180), 1);
+    warpAffine(src, turned, back, src.size());
+
+    // the contrast and brightness filters give round(.975*(g-100)) for g >= 100
+    uchar lut[256];
+    for(int v=0;v<256;v++) {
+        lut[v] = (uchar)std::min(255L, lrint(v / .975) + 100);
+    }
+
+    // rearrangePixelsFilter reads (y+ROW_SHIFT, x+COL_SHIFT) with its channels rotated
+    out.create(rows, cols, CV_8UC3);
+    for(int y=0;y<rows;y++) {
+        const uchar* p = turned.ptr(y);
+        uchar* q = out.ptr((y+ROW_SHIFT)%rows);
+        for(int x=0;x<cols;x++) {
+            uchar* g = q + 3*((x+COL_SHIFT)%cols);
+            g[0] = lut[p[3*x+2]];
+            g[1] = lut[p[3*x]];
+            g[2] = lut[p[3*x+1]];
+        }
+    }
+}
+
+// Largest and mean absolute difference of a and b inside the circle the rotations keep
+static void sourceError(const Mat& a, const Mat& b, int* maxErr, double* meanErr)
+{
+    const int cx = a.cols/2, cy = a.rows/2;
+    const double r = std::min(a.rows, a.cols)/2.0 - CIRCLE_MARGIN;
+    long sum = 0, n = 0;
+    *maxErr = 0;
+    for(int y=0;y<a.rows;y++) {
+        const uchar* p = a.ptr(y);
+        const uchar* q = b.ptr(y);
+        for(int x=0;x<a.cols;x++) {
+            if((double)(x-cx)*(x-cx) + (double)(y-cy)*(y-cy) > r*r) {
+                continue;
+            }
+            for(int c=0;c<3;c++) {
+                const int d = abs((int)p[3*x+c] - (int)q[3*x+c]);
+                *maxErr = std::max(*maxErr, d);
+                sum += d;
+                n++;
+            }
+        }
+    }
+    *meanErr = n > 0 ? (double)sum / n : 0.0;
+}
+
+typedef struct _benchRun {
+    double seconds;
+    PipelineStats stats;                // only the latencies, for the serial runs
+    std::vector<uint64_t> hashes;       // per output frame
+} BenchRun;
+
+// The serial program's loop; the sources are regenerated to check the output, off the clock
+static void runSerial(bool fused, const std::vector<Mat>& garbled, BenchRun* run, int* maxErr, double* meanErr)
+{
+    const int frames = garbled.size();
+    statsInit(&run->stats, frames);
+    run->hashes.assign(frames, 0);
+    run->seconds = 0.0;
+    Mat frame, brightFrameReturn, contrastFrameReturn, pixelsFrameReturn, rotateFrameReturn, source;
+    *maxErr = 0;
+    *meanErr = 0.0;
+    for(int i=0;i<frames;i++) {
+        const tbb::tick_count start = tbb::tick_count::now();
+        // a copy, as the pipeline's source stage makes
+        garbled[i].copyTo(frame);
+        if(fused) {
+            fusedUngarbleFilter(serial_for(), frame, rotateFrameReturn);
+        } else {
+            decreaseBrightnessFilter(frame, brightFrameReturn);
+            decreaseContrastFilter(brightFrameReturn, contrastFrameReturn);
+            rearrangePixelsFilter(contrastFrameReturn, pixelsFrameReturn);
+            rotateMatFilter(pixelsFrameReturn, rotateFrameReturn);
+        }
+        run->hashes[i] = frameHash(rotateFrameReturn);
+        const double seconds = (tbb::tick_count::now() - start).seconds();
+        run->stats.latency[i] = seconds;
+        run->seconds += seconds;
+
+        int frameMax;
+        double frameMean;
+        sourceFrame(frame.rows, frame.cols, i, source);
+        sourceError(rotateFrameReturn, source, &frameMax, &frameMean);
+        *maxErr = std::max(*maxErr, frameMax);
+        *meanErr += frameMean / frames;
+    }
+}
+
+// pipeline_tbb's stages (pipeline_stages.cpp), with a source stage that copies the frames from memory
+static void runPipeline(bool fused, const std::vector<Mat>& garbled, int tokens, BenchRun* run)
+{
+    const int frames = garbled.size();
+    FramePool pool;
+    framePoolInit(&pool, tokens);
+    FrameSink sink;
+    sinkOpen(&sink, "sum");
+    PipelineStats& stats = run->stats;
+    statsInit(&stats, frames);
+    const int sourceStage = statsStage(&stats, "source", true);
+    tbb::filter_t<FrameToken*,FrameToken*> filters = filterStages(&pool, &stats, fused);
+    tbb::filter_t<FrameToken*,void> output = outputStages(&sink, &pool, &stats,
+        [run](FrameToken* t) { run->hashes[t->index] = t->hash; });
+    run->hashes.assign(frames, 0);
+
+    int next = 0;
+    const tbb::tick_count start = tbb::tick_count::now();
+    tbb::parallel_pipeline (
+        tokens,
+        tbb::make_filter<void,FrameToken*>(
+            tbb::filter::serial_in_order,
+            [&]( tbb::flow_control& fc ) -> FrameToken* {
+                if (next == frames) {
+                    fc.stop();
+                    return NULL;
+                }
+                FrameToken* t = framePoolGet(&pool);
+                t->index = next++;
+                timedStage(&stats, sourceStage, t, [&]() { garbled[t->index].copyTo(tokenFrame(t)); });
+                return t;
+            }
+        ) &
+        filters &
+        output
+    );
+    run->seconds = (tbb::tick_count::now() - start).seconds();
+    framePoolFree(&pool);
+}
+
+static void report(const char* name, const BenchRun* run, const BenchRun* serial)
+{
+    int differ = 0;
+    for(size_t i=0;i<run->hashes.size();i++) {
+        differ += run->hashes[i] != serial->hashes[i];
+    }
+    const int frames = run->hashes.size();
+    printf("%-15s %8.1f %9.3f %9.3f %9.3f %7d\n", name, frames / run->seconds,
+           1e3 * statsLatency(&run->stats, 50), 1e3 * statsLatency(&run->stats, 95),
+           1e3 * statsLatency(&run->stats, 100), differ);
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+    int tokens = 4;
+    bool badArgs = false;
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        switch(opt) {
+            case 'n': tokens = atoi(optarg); badArgs = badArgs || tokens < 1; break;
+            default: badArgs = true;
+        }
+    }
+    const int frames = optind < argc ? atoi(argv[optind]) : 32;
+    std::vector<Size> sizes;
+    for(int i=optind+1;i<argc;i++) {
+        int w, h;
+        if(sscanf(argv[i], "%dx%d", &w, &h) != 2 || w < 1 || h < 1) {
+            badArgs = true;
+            break;
+        }
+        sizes.push_back(Size(w, h));
+    }
+    if(sizes.empty()) {
+        sizes.push_back(Size(640, 480));
+        sizes.push_back(Size(1920, 1080));
+    }
+    if(badArgs || frames < 1) {
+        printf("Usage: %s [-n tokens] [frames] [WxH ...]\n", argv[0]);
+        return 1;
+    }
+
+    const int workers = tbb::task_scheduler_init::default_num_threads();
+    bool pass = true;
+    for(size_t s=0;s<sizes.size();s++) {
+        const int rows = sizes[s].height, cols = sizes[s].width;
+        std::vector<Mat> garbled(frames);
+        Mat source;
+        for(int i=0;i<frames;i++) {
+            sourceFrame(rows, cols, i, source);
+            garbleFrame(source, garbled[i]);
+        }
+        // the fused filter's remap table is built once per size, off the clock
+        Mat warm;
+        fusedUngarbleFilter(serial_for(), garbled[0], warm);
+
+        printf("%dx%d, %d frames, %d tokens, %d workers\n", cols, rows, frames, tokens, workers);
+        printf("%-15s %8s %9s %9s %9s %7s\n", "run", "fps", "p50 ms", "p95 ms", "max ms", "differ");
+        BenchRun serial, serialFused, pipeline, pipelineFused;
+        int maxErr, fusedMaxErr;
+        double meanErr, fusedMeanErr;
+        runSerial(false, garbled, &serial, &maxErr, &meanErr);
+        runSerial(true, garbled, &serialFused, &fusedMaxErr, &fusedMeanErr);
+        runPipeline(false, garbled, tokens, &pipeline);
+        runPipeline(true, garbled, tokens, &pipelineFused);
+        report("serial", &serial, &serial);
+        report("serial fused", &serialFused, &serial);
+        report("pipeline", &pipeline, &serial);
+        report("pipeline fused", &pipelineFused, &serial);
+        printf("Against the source frames, inside the kept circle: max %d, mean %.3f levels\n\n", maxErr, meanErr);
+
+        for(int i=0;i<frames;i++) {
+            pass = pass && serialFused.hashes[i] == serial.hashes[i] && pipeline.hashes[i] == serial.hashes[i]
+                        && pipelineFused.hashes[i] == serial.hashes[i];
+        }
+        pass = pass && maxErr <= MAX_SOURCE_ERROR && meanErr <= MAX_SOURCE_MEAN;
+    }
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
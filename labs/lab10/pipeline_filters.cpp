@@ -0,0 +1,312 @@
+#ifndef PIPELINE_FILTERS
+#define PIPELINE_FILTERS
+/*
+ * The filters that ungarble a frame, shared by the pipeline programs.
+ *
+ * The four original filters run one after another, each writing a whole
+ * frame. fusedUngarbleFilter() gives the same output in one pass:
+ *
+ *     brightness, contrast  act on each channel value alone, so together they
+ *                           are a table of 256 values. The table is made by
+ *                           running the two filters over the values 0..255,
+ *                           so it rounds and saturates exactly as they do.
+ *     rearrange, rotate     only move pixels. The rotation reads each output
+ *                           pixel from four neighbours of a point in the
+ *                           rearranged frame, and row y, column x of the
+ *                           rearranged frame is row (y+ROW_SHIFT)%rows,
+ *                           column (x+COL_SHIFT)%cols of the garbled frame
+ *                           with its channels rotated. So a remap table, the
+ *                           point and bilinear weights of every output pixel,
+ *                           reads the output straight from the garbled frame.
+ *
+ * The remap table is built once per frame size. It holds what OpenCV 2.x
+ * warpAffine computes for INTER_LINEAR: the point in 1/32 pixel fixed point
+ * and weights that sum to 1<<15. Neighbours outside the frame count as
+ * black, as warpAffine's BORDER_CONSTANT does. (OpenCV 4.11 and later
+ * interpolate warpAffine in floating point instead, which can differ by a
+ * level at interpolated pixels.)
+ *
+ * Rows are split with the program's parallel loop functor
+ *     pfor(begin, end, f)  calls f(b, e) on disjoint sub-ranges covering [begin, end)
+ *
+ * Built with SSSE3 (-mssse3), rearrangePixelsFilter() rotates the channels
+ * of five pixels at a time with pshufb; without it, one pixel at a time.
+ */
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+// The garbling this undoes
+static const int ROTATE_ANGLE = 340;
+static const int ROW_SHIFT = 375;
+static const int COL_SHIFT = 475;
+
+// pfor for the serial program: the whole range in one call
+struct serial_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        if(begin < end)
+            f(begin, end);
+    }
+};
+
+//filter to decrease the contrast
+void decreaseContrastFilter(Mat &inFrame, Mat &outFrame)
+{
+	//decrease the contrast 1/1.025
+	inFrame.convertTo(outFrame, -1, .975, 0);
+} //END decreaseContrastFilter
+
+
+//filter to decrease the brightness
+void decreaseBrightnessFilter(Mat &frame, Mat &outFrame)
+{
+		//decrease the brightness by 100 units, into outFrame's buffer when it fits
+		subtract(frame, Scalar(100, 100, 100), outFrame);
+} //END decreaseBrightnessFilter
+
+
+//filter to rotate a frame
+void rotateMatFilter(Mat &frame, Mat &outFrame)
+{
+	int iAngle = ROTATE_ANGLE;
+	Mat matRotation = getRotationMatrix2D(Point(frame.cols/2, frame.rows/2), (iAngle-180), 1);
+	warpAffine( frame, outFrame, matRotation, frame.size());
+
+} //END rotateMatFilter()
+
+
+// Copies n pixels from src to dst, output channel c from source channel (c+1)%3
+static inline void rotateChannelsCopy(const uchar* src, uchar* dst, int n)
+{
+    int i = 0;
+#ifdef __SSSE3__
+    // one pshufb moves five pixels; the sixteenth byte is the next pixel's, which the next step rewrites
+    const __m128i order = _mm_setr_epi8(1, 2, 0, 4, 5, 3, 7, 8, 6, 10, 11, 9, 13, 14, 12, 15);
+    for(; 3*i + 16 <= 3*n; i += 5) {
+        const __m128i p = _mm_loadu_si128((const __m128i*)(src + 3*i));
+        _mm_storeu_si128((__m128i*)(dst + 3*i), _mm_shuffle_epi8(p, order));
+    }
+#endif
+    for(; i < n; i++) {
+        dst[3*i] = src[3*i+1];
+        dst[3*i+1] = src[3*i+2];
+        dst[3*i+2] = src[3*i];
+    }
+}
+
+
+/**----------------------------------------------------------------------------
+ * Filter to rearange the pixels in a frame: row y, column x of outFrame is
+ * row (y+ROW_SHIFT)%rows, column (x+COL_SHIFT)%cols of frame, with its
+ * channels rotated. A shifted row is two runs of the source row, the columns
+ * from the shift to the end and then those before it, so each output row is
+ * copied as two spans, shuffling the channels as they are copied. The rows
+ * are split with pfor. outFrame must not be frame.
+ */
+template<typename ParallelFor>
+void rearrangePixelsFilter(const ParallelFor& pfor, const Mat &frame, Mat &outFrame)
+{
+	//every pixel is written below, so the buffer only needs the size
+	outFrame.create(frame.size(), frame.type());
+	const int rows = frame.rows, cols = frame.cols;
+	const int shift = COL_SHIFT % cols;
+	pfor(0, rows, [=, &frame, &outFrame](int b, int e) {
+		for (int y = b; y < e; y++) {
+			const uchar* src = frame.ptr((y+ROW_SHIFT)%rows);
+			uchar* dst = outFrame.ptr(y);
+			rotateChannelsCopy(src + 3*shift, dst, cols - shift);
+			rotateChannelsCopy(src, dst + 3*(cols - shift), shift);
+		}
+	});
+} //END rearangePixelsFilter()
+
+
+// The filter on one thread, as pipeline_serial calls it
+void rearrangePixelsFilter(Mat &frame, Mat &outFrame)
+{
+	rearrangePixelsFilter(serial_for(), frame, outFrame);
+} //END rearangePixelsFilter()
+
+
+// Fixed point of the remap table, as in OpenCV's remap
+static const int REMAP_BITS = 5;
+static const int REMAP_SIZE = 1 << REMAP_BITS;
+static const int REMAP_COEF_BITS = 15;
+// Set in frac when a neighbour of the point is outside the frame
+static const uint16_t REMAP_EDGE = 0x8000;
+
+typedef struct _fusedMap {
+    int rows;
+    int cols;
+    std::vector<int16_t> xy;        // xy[2*(y*cols+x)+{0,1}]: the point's top-left neighbour in the rearranged frame
+    std::vector<uint16_t> frac;     // fy*REMAP_SIZE + fx, | REMAP_EDGE
+    std::vector<int> srcRow;        // rearranged row -> garbled row
+    std::vector<int> srcCol;        // rearranged column -> byte offset of the garbled column
+    uint16_t weights[REMAP_SIZE*REMAP_SIZE][4];
+    uchar lut[256];                 // brightness then contrast
+} FusedMap;
+
+// Builds the remap table for rows x cols frames
+void fusedMapBuild(FusedMap* m, int rows, int cols)
+{
+    m->rows = rows;
+    m->cols = cols;
+
+    // the value table, from the filters themselves
+    Mat values(1, 256, CV_8UC3), bright, contrast;
+    for(int v=0;v<256;v++) {
+        values.at<Vec3b>(0,v) = Vec3b(v, v, v);
+    }
+    decreaseBrightnessFilter(values, bright);
+    decreaseContrastFilter(bright, contrast);
+    for(int v=0;v<256;v++) {
+        m->lut[v] = contrast.at<Vec3b>(0,v)[0];
+    }
+
+    m->srcRow.resize(rows);
+    m->srcCol.resize(cols);
+    for(int y=0;y<rows;y++) {
+        m->srcRow[y] = (y+ROW_SHIFT)%rows;
+    }
+    for(int x=0;x<cols;x++) {
+        m->srcCol[x] = 3*((x+COL_SHIFT)%cols);
+    }
+
+    for(int fy=0;fy<REMAP_SIZE;fy++) {
+        for(int fx=0;fx<REMAP_SIZE;fx++) {
+            uint16_t* w = m->weights[fy*REMAP_SIZE + fx];
+            const int scale = 1 << (REMAP_COEF_BITS - 2*REMAP_BITS);
+            w[0] = (REMAP_SIZE-fx)*(REMAP_SIZE-fy)*scale;
+            w[1] = fx*(REMAP_SIZE-fy)*scale;
+            w[2] = (REMAP_SIZE-fx)*fy*scale;
+            w[3] = fx*fy*scale;
+        }
+    }
+
+    // warpAffine's inverse map, rounded the way it rounds
+    Mat rot = getRotationMatrix2D(Point(cols/2, rows/2), (ROTATE_ANGLE-180), 1);
+    double M[6];
+    for(int i=0;i<6;i++) {
+        M[i] = rot.at<double>(i/3, i%3);
+    }
+    double D = M[0]*M[4] - M[1]*M[3];
+    D = D != 0 ? 1./D : 0;
+    const double A11 = M[4]*D, A22 = M[0]*D;
+    M[0] = A11; M[1] *= -D;
+    M[3] *= -D; M[4] = A22;
+    const double b1 = -M[0]*M[2] - M[1]*M[5];
+    const double b2 = -M[3]*M[2] - M[4]*M[5];
+    M[2] = b1; M[5] = b2;
+
+    const int abBits = 10;
+    const int abScale = 1 << abBits;
+    const int roundDelta = abScale/REMAP_SIZE/2;
+    std::vector<int> adelta(cols), bdelta(cols);
+    for(int x=0;x<cols;x++) {
+        adelta[x] = saturate_cast<int>(M[0]*x*abScale);
+        bdelta[x] = saturate_cast<int>(M[3]*x*abScale);
+    }
+    m->xy.resize((size_t)rows*cols*2);
+    m->frac.resize((size_t)rows*cols);
+    for(int y=0;y<rows;y++) {
+        const int X0 = saturate_cast<int>((M[1]*y + M[2])*abScale) + roundDelta;
+        const int Y0 = saturate_cast<int>((M[4]*y + M[5])*abScale) + roundDelta;
+        for(int x=0;x<cols;x++) {
+            const int X = (X0 + adelta[x]) >> (abBits - REMAP_BITS);
+            const int Y = (Y0 + bdelta[x]) >> (abBits - REMAP_BITS);
+            const int sx = X >> REMAP_BITS, sy = Y >> REMAP_BITS;
+            const size_t i = (size_t)y*cols + x;
+            m->xy[2*i] = saturate_cast<short>(sx);
+            m->xy[2*i+1] = saturate_cast<short>(sy);
+            m->frac[i] = (uint16_t)((Y & (REMAP_SIZE-1))*REMAP_SIZE + (X & (REMAP_SIZE-1)));
+            if(sx < 0 || sx+1 >= cols || sy < 0 || sy+1 >= rows) {
+                m->frac[i] |= REMAP_EDGE;
+            }
+        }
+    }
+} //END fusedMapBuild()
+
+
+// The remap table for rows x cols frames, built on first use
+const FusedMap* fusedMapFor(int rows, int cols)
+{
+    static std::mutex lock;
+    static std::vector<FusedMap*> maps;
+    std::lock_guard<std::mutex> hold(lock);
+    for(size_t i=0;i<maps.size();i++) {
+        if(maps[i]->rows == rows && maps[i]->cols == cols) {
+            return maps[i];
+        }
+    }
+    FusedMap* m = new FusedMap;
+    fusedMapBuild(m, rows, cols);
+    maps.push_back(m);
+    return m;
+} //END fusedMapFor()
+
+
+// An output pixel with neighbours outside the frame; those count as black
+static void fusedEdgePixel(const FusedMap* m, const Mat &frame, int sx, int sy, int frac, uchar* out)
+{
+    const uint16_t* w = m->weights[frac & ~REMAP_EDGE];
+    int acc[3] = { 0, 0, 0 };
+    for(int k=0;k<4;k++) {
+        const int x = sx + (k & 1), y = sy + (k >> 1);
+        if(x < 0 || x >= m->cols || y < 0 || y >= m->rows) {
+            continue;
+        }
+        const uchar* p = frame.ptr(m->srcRow[y]) + m->srcCol[x];
+        acc[0] += w[k]*m->lut[p[1]];
+        acc[1] += w[k]*m->lut[p[2]];
+        acc[2] += w[k]*m->lut[p[0]];
+    }
+    for(int c=0;c<3;c++) {
+        out[c] = (uchar)((acc[c] + (1 << (REMAP_COEF_BITS-1))) >> REMAP_COEF_BITS);
+    }
+}
+
+
+/**----------------------------------------------------------------------------
+ * The four filters in one pass: outFrame is what rotateMatFilter gives after
+ * decreaseBrightnessFilter, decreaseContrastFilter and rearrangePixelsFilter.
+ * outFrame must not be frame.
+ */
+template<typename ParallelFor>
+void fusedUngarbleFilter(const ParallelFor& pfor, const Mat &frame, Mat &outFrame)
+{
+    const FusedMap* m = fusedMapFor(frame.rows, frame.cols);
+    outFrame.create(frame.rows, frame.cols, CV_8UC3);
+    const int cols = m->cols;
+    const uchar* const lut = m->lut;
+    pfor(0, m->rows, [=, &frame, &outFrame](int b, int e) {
+        for(int y=b;y<e;y++) {
+            const int16_t* xy = &m->xy[(size_t)y*cols*2];
+            const uint16_t* frac = &m->frac[(size_t)y*cols];
+            uchar* out = outFrame.ptr(y);
+            for(int x=0;x<cols;x++, out+=3) {
+                const int sx = xy[2*x], sy = xy[2*x+1];
+                if(frac[x] & REMAP_EDGE) {
+                    fusedEdgePixel(m, frame, sx, sy, frac[x], out);
+                    continue;
+                }
+                const uint16_t* w = m->weights[frac[x]];
+                const uchar* r0 = frame.ptr(m->srcRow[sy]);
+                const uchar* r1 = frame.ptr(m->srcRow[sy+1]);
+                const uchar* p0 = r0 + m->srcCol[sx];
+                const uchar* p1 = r0 + m->srcCol[sx+1];
+                const uchar* p2 = r1 + m->srcCol[sx];
+                const uchar* p3 = r1 + m->srcCol[sx+1];
+                // output channel c is garbled channel (c+1)%3
+                for(int c=0;c<3;c++) {
+                    const int s = c == 2 ? 0 : c+1;
+                    const int acc = w[0]*lut[p0[s]] + w[1]*lut[p1[s]] + w[2]*lut[p2[s]] + w[3]*lut[p3[s]];
+                    out[c] = (uchar)((acc + (1 << (REMAP_COEF_BITS-1))) >> REMAP_COEF_BITS);
+                }
+            }
+        }
+    });
+} //END fusedUngarbleFilter()
+#endif
@@ -0,0 +1,179 @@
+#ifndef PIPELINE_POOL
+#define PIPELINE_POOL
+/*
+ * Frames in flight through the pipeline, allocated once.
+ *
+ * parallel_pipeline never has more than ntoken frames in flight, so a pool
+ * of ntoken FrameTokens always has a free one when the input stage asks:
+ * the input stage takes a token, the stages pass it along, and the sink
+ * puts it back. The free tokens are a lock-free stack of token numbers
+ * whose head also holds a count of the pushes, so a pop that was overtaken
+ * by a pop and a push of the same token fails its compare-and-swap instead
+ * of taking a stale next.
+ *
+ * A token carries the file bytes and two frames; each stage reads one
+ * frame and writes the other. The filters write with Mat::create, which
+ * keeps a buffer of the same size and type, so a token only allocates for
+ * its first frame (or when the frame size changes). framePoolCount() counts
+ * the buffers a stage did allocate, split into those for a token's first
+ * frame and those after, which stay at zero for a run of same-size frames.
+ * It decides from what the buffer was before the stage, not from whether
+ * the address changed, since a freed buffer can come back at the same
+ * address: Mat::create keeps a buffer only if it had one of the size and
+ * type it gets and shared it with no other Mat, and a vector keeps its
+ * buffer while the bytes fit its capacity. Only the token's buffers are
+ * counted; what the codecs allocate inside imdecode and VideoCapture is not.
+ */
+#include <stdint.h>
+#include <vector>
+
+typedef struct _frameToken {
+    int index;                  // frame number, in input order
+    int uses;                   // frames this token has carried
+    std::vector<uchar> bytes;   // the frame's file
+    Mat frame[2];               // frame[current] holds the frame
+    int current;
+    double begun;               // pipeline_stats.cpp clock: the frame's first stage started
+    double stageEnd;            // and its latest stage finished
+    uint64_t hash;              // pipeline_sinks.cpp: the frame's checksum (-o sum)
+    bool written;               // and whether its parallel stage left anything to commit
+    tbb::atomic<int> next;      // free stack link, token number + 1
+} FrameToken;
+
+typedef struct _framePool {
+    FrameToken* tokens;
+    int size;
+    tbb::atomic<uint64_t> head;            // pushes << 32 | token number + 1, 0 when empty
+    tbb::atomic<long> warmupAllocations;   // buffers allocated for a token's first frame
+    tbb::atomic<long> steadyAllocations;   // and after
+} FramePool;
+
+static const uint64_t POOL_TOP = 0xffffffffu;
+
+// Puts t back on the free stack
+void framePoolPut(FramePool* p, FrameToken* t)
+{
+    const uint64_t number = (uint64_t)(t - p->tokens) + 1;
+    for(;;) {
+        const uint64_t old = p->head;
+        t->next = (int)(old & POOL_TOP);
+        const uint64_t top = (((old >> 32) + 1) << 32) | number;
+        if(p->head.compare_and_swap(top, old) == old) {
+            return;
+        }
+    }
+}
+
+// Takes a free token, NULL if there is none
+FrameToken* framePoolGet(FramePool* p)
+{
+    for(;;) {
+        const uint64_t old = p->head;
+        const int number = (int)(old & POOL_TOP);
+        if(number == 0) {
+            return NULL;
+        }
+        FrameToken* t = &p->tokens[number - 1];
+        const uint64_t top = (old & ~POOL_TOP) | (uint64_t)(int)t->next;
+        if(p->head.compare_and_swap(top, old) == old) {
+            return t;
+        }
+    }
+}
+
+void framePoolInit(FramePool* p, int size)
+{
+    p->tokens = new FrameToken[size];
+    p->size = size;
+    p->head = 0;
+    p->warmupAllocations = 0;
+    p->steadyAllocations = 0;
+    for(int i=size-1;i>=0;i--) {
+        p->tokens[i].uses = 0;
+        p->tokens[i].current = 0;
+        framePoolPut(p, &p->tokens[i]);
+    }
+}
+
+void framePoolFree(FramePool* p)
+{
+    delete[] p->tokens;
+    p->tokens = NULL;
+}
+
+static inline void framePoolAdd(FramePool* p, const FrameToken* t)
+{
+    if(t->uses == 0) {
+        p->warmupAllocations++;
+    } else {
+        p->steadyAllocations++;
+    }
+}
+
+// A frame buffer as it was before a stage wrote it
+typedef struct _frameBefore {
+    const void* data;
+    Size size;
+    int type;
+    bool shared;
+} FrameBefore;
+
+static inline FrameBefore frameBefore(const Mat& m)
+{
+    FrameBefore b;
+    b.data = m.data;
+    b.size = m.size();
+    b.type = m.type();
+    b.shared = m.refcount != NULL && *m.refcount > 1;
+    return b;
+}
+
+// Counts an allocation if the stage that left the frame after could not have kept the buffer it had before
+static inline void framePoolCount(FramePool* p, const FrameToken* t, const FrameBefore& before, const Mat& after)
+{
+    if(after.data == NULL) {
+        return;
+    }
+    if(before.data == NULL || before.shared || before.size != after.size() || before.type != after.type() ||
+       before.data != after.data) {
+        framePoolAdd(p, t);
+    }
+}
+
+// The same for the file bytes, given their capacity before the stage
+static inline void framePoolCountBytes(FramePool* p, const FrameToken* t, size_t capacity, const void* before,
+                                       const std::vector<uchar>& after)
+{
+    if(!after.empty() && (after.size() > capacity || before != after.data())) {
+        framePoolAdd(p, t);
+    }
+}
+
+// The frame the token carries, and the one the next stage writes
+static inline Mat& tokenFrame(FrameToken* t)
+{
+    return t->frame[t->current];
+}
+
+static inline Mat& tokenOutput(FrameToken* t)
+{
+    return t->frame[1 - t->current];
+}
+
+// Runs filter(in, out) on the token's frame; out becomes the token's frame
+template<typename Filter>
+void tokenFilter(FramePool* p, FrameToken* t, const Filter& filter)
+{
+    Mat& out = tokenOutput(t);
+    const FrameBefore before = frameBefore(out);
+    filter(tokenFrame(t), out);
+    framePoolCount(p, t, before, out);
+    t->current = 1 - t->current;
+}
+
+void framePoolReport(const FramePool* p, int frames)
+{
+    printf("%d frames, %d pooled tokens: %ld frame buffers allocated while the pool filled, %ld after\n",
+           frames, p->size, (long)p->warmupAllocations, (long)p->steadyAllocations);
+}
+#endif
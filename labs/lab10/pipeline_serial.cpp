@@ -5,6 +5,8 @@
 
 using namespace cv;
 
+#include "pipeline_filters.cpp"
+
 //----Method Declarations
 static void ungarbleVideo(char**,int);
 //----END Method Declarations
@@ -30,50 +32,6 @@ void readFrame(VideoCapture &input_cap, Mat& readFrame, int *outOfFrames)
 }
 
 
-//filter to decrease the contrast
-void decreaseContrastFilter(Mat &inFrame, Mat &outFrame) 
-{
-	//decrease the contrast 1/1.025
-	inFrame.convertTo(outFrame, -1, .975, 0); 
-} //END decreaseContrastFilter
-
-
-//filter to decrease the brightness
-void decreaseBrightnessFilter(Mat &frame, Mat &outFrame)
-{				
-		//decrease the brightness by 100 units
-		outFrame =  frame - Scalar(100, 100, 100); 
-} //END decreaseBrightnessFilter
-
-
-//filter to rotate a frame
-void rotateMatFilter(Mat &frame, Mat &outFrame) 
-{
-	int iAngle = 340;
-	Mat matRotation = getRotationMatrix2D(Point(frame.cols/2, frame.rows/2), (iAngle-180), 1);	 
-	warpAffine( frame, outFrame, matRotation, frame.size());
-			
-} //END rotateMatFilter()
-
-
-//filter to rearange the pixels in a frame
-void rearrangePixelsFilter(Mat &frame, Mat &outFrame) 
-{
-	outFrame = frame.clone();
-		for (int y = 0; y < frame.rows; y++) {
-			for (int x = 0; x < frame.cols; x++) {
-				int r, g, b;
-				r = frame.at<cv::Vec3b>((y+375)%(outFrame.rows),(x+475)%(outFrame.cols))[0];
-				g = frame.at<cv::Vec3b>((y+375)%(outFrame.rows),(x+475)%(outFrame.cols))[1];
-				b = frame.at<cv::Vec3b>((y+375)%(outFrame.rows),(x+475)%(outFrame.cols))[2];
-				outFrame.at<cv::Vec3b>(y,x)[0] = g;
-				outFrame.at<cv::Vec3b>(y,x)[1] = b;
-				outFrame.at<cv::Vec3b>(y,x)[2] = r;
-			}
-		}	
-} //END rearangePixelsFilter()
-
-
 //function to write a frame
 void writeFrame(VideoWriter &output_cap, Mat &outFrame)
 {
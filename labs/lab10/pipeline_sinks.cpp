@@ -0,0 +1,306 @@
+#ifndef PIPELINE_SINKS
+#define PIPELINE_SINKS
+/*
+ * Where the ungarbled frames go (-o).
+ *
+ *     display            imshow + waitKey, as the lab started with
+ *     seq:dir/f%05d.png  one image per frame written, numbered from 0 in
+ *                        order; frames are encoded and written to a .part
+ *                        file named by input position in parallel, and the
+ *                        serial stage renames each to the next number, so
+ *                        frames that did not decode or write leave no gap
+ *                        and the finished names are always a prefix
+ *     raw:file           every frame's BGR bytes, row after row, one frame
+ *                        after another; file may be a pipe, or - for stdout
+ *                        (the reports then go to stderr)
+ *     video:file.avi     a video, Motion JPEG at the input video's frame rate
+ *                        (VIDEO_FPS for image files), through writeFrame()
+ *     sum                a checksum of the frames, hashed in parallel and
+ *                        combined in order, to compare runs
+ *     null               discards the frames, to time the rest
+ *
+ * A sink has an optional parallel stage, sinkPrepare(), and a serial in
+ * order one, sinkCommit(). Frames that did not decode are skipped.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+enum SinkKind { SINK_DISPLAY, SINK_SEQUENCE, SINK_RAW, SINK_VIDEO, SINK_SUM, SINK_NULL };
+
+// Frame rate of a video made from image files
+static const double VIDEO_FPS = 30.0;
+
+typedef struct _frameSink {
+    SinkKind kind;
+    const char* target;     // seq: the name pattern, raw: the file
+    const char* ext;        // seq: the pattern's extension, for imencode
+    int fd;                 // raw
+    VideoWriter writer;     // video, opened with the first frame's size
+    double fps;             // video
+    uint64_t checksum;      // sum: the frame hashes, combined in order
+    long frames;            // frames committed
+    long failures;          // frames that could not be written
+} FrameSink;
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ull;
+static const uint64_t FNV_PRIME = 1099511628211ull;
+
+// True if pattern has exactly one conversion, a %d with an optional 0 and width
+static bool sinkPatternOk(const char* pattern)
+{
+    int conversions = 0;
+    for(const char* p = pattern; *p; p++) {
+        if(*p != '%') {
+            continue;
+        }
+        p++;
+        while(*p >= '0' && *p <= '9') {
+            p++;
+        }
+        if(*p != 'd') {
+            return false;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// Sets up the sink named by spec; false if spec is not one
+bool sinkOpen(FrameSink* s, const char* spec)
+{
+    s->target = NULL;
+    s->ext = NULL;
+    s->fd = -1;
+    s->fps = VIDEO_FPS;
+    s->checksum = FNV_OFFSET;
+    s->frames = 0;
+    s->failures = 0;
+    if(strcmp(spec, "display") == 0) {
+        s->kind = SINK_DISPLAY;
+    } else if(strcmp(spec, "sum") == 0) {
+        s->kind = SINK_SUM;
+    } else if(strcmp(spec, "null") == 0) {
+        s->kind = SINK_NULL;
+    } else if(strncmp(spec, "seq:", 4) == 0) {
+        s->kind = SINK_SEQUENCE;
+        s->target = spec + 4;
+        s->ext = strrchr(s->target, '.');
+        if(s->ext == NULL || strchr(s->ext, '/') != NULL || !sinkPatternOk(s->target)) {
+            fprintf(stderr, "seq: needs a name with one %%d and an image extension, like out/frame_%%05d.png\n");
+            return false;
+        }
+    } else if(strncmp(spec, "raw:", 4) == 0) {
+        s->kind = SINK_RAW;
+        s->target = spec + 4;
+        if(strcmp(s->target, "-") == 0) {
+            // keep the frames on stdout and send the reports to stderr
+            s->fd = dup(1);
+            dup2(2, 1);
+        } else {
+            s->fd = open(s->target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if(s->fd < 0) {
+            fprintf(stderr, "Error opening %s: %s\n", s->target, strerror(errno));
+            return false;
+        }
+    } else if(strncmp(spec, "video:", 6) == 0 && spec[6] != '\0') {
+        s->kind = SINK_VIDEO;
+        s->target = spec + 6;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Whether the sink has a parallel stage, and the names of its stages
+bool sinkParallel(const FrameSink* s)
+{
+    return s->kind == SINK_SEQUENCE || s->kind == SINK_SUM;
+}
+
+const char* sinkPrepareName(const FrameSink* s)
+{
+    return s->kind == SINK_SEQUENCE ? "encode" : "hash";
+}
+
+const char* sinkCommitName(const FrameSink* s)
+{
+    switch(s->kind) {
+        case SINK_SEQUENCE: return "commit";
+        case SINK_RAW: return "write";
+        case SINK_VIDEO: return "encode";
+        case SINK_SUM: return "checksum";
+        case SINK_NULL: return "discard";
+        default: return "display";
+    }
+}
+
+// Writes all n bytes at p to fd
+static bool writeAll(int fd, const void* p, size_t n)
+{
+    const char* c = (const char*)p;
+    while(n > 0) {
+        const ssize_t w = write(fd, c, n);
+        if(w < 0 && errno == EINTR) {
+            continue;
+        }
+        if(w <= 0) {
+            return false;
+        }
+        c += w;
+        n -= w;
+    }
+    return true;
+}
+
+//function to write a frame
+void writeFrame(VideoWriter &output_cap, Mat &outFrame)
+{
+	output_cap.write(outFrame);
+} //END writeFrame()
+
+
+// FNV-1a over the frame's pixels
+static uint64_t frameHash(const Mat& frame)
+{
+    uint64_t h = FNV_OFFSET;
+    const size_t row = (size_t)frame.cols * frame.elemSize();
+    for(int y=0;y<frame.rows;y++) {
+        const uchar* p = frame.ptr(y);
+        for(size_t i=0;i<row;i++) {
+            h = (h ^ p[i]) * FNV_PRIME;
+        }
+    }
+    return h;
+}
+
+/**----------------------------------------------------------------------------
+ * The parallel part: seq encodes the frame into the token's byte buffer and
+ * writes it to name.part, with name numbered by the frame's input position,
+ * sum hashes it into t->hash. t->written says
+ * whether there is something to commit.
+ */
+void sinkPrepare(FrameSink* s, FrameToken* t)
+{
+    const Mat& frame = tokenFrame(t);
+    t->written = frame.data != NULL;
+    if(!t->written) {
+        return;
+    }
+    if(s->kind == SINK_SUM) {
+        t->hash = frameHash(frame);
+    } else if(s->kind == SINK_SEQUENCE) {
+        char name[PATH_MAX], part[PATH_MAX + 8];
+        snprintf(name, sizeof(name), s->target, t->index);
+        snprintf(part, sizeof(part), "%s.part", name);
+        t->written = false;
+        if(imencode(s->ext, frame, t->bytes)) {
+            const int fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd >= 0) {
+                t->written = writeAll(fd, t->bytes.data(), t->bytes.size());
+                t->written = close(fd) == 0 && t->written;
+            }
+        }
+        if(!t->written) {
+            fprintf(stderr, "Error writing %s\n", part);
+        }
+    }
+}
+
+// The serial, in order part
+void sinkCommit(FrameSink* s, FrameToken* t)
+{
+    Mat& frame = tokenFrame(t);
+    bool ok = true;
+    switch(s->kind) {
+        case SINK_DISPLAY:
+            if(frame.data == NULL) {
+                return;
+            }
+            imshow("Nuclear Fusion", frame);
+            waitKey(1);
+            break;
+        case SINK_SEQUENCE: {
+            if(frame.data == NULL) {
+                return;
+            }
+            if(!t->written) {
+                s->failures++;
+                return;
+            }
+            // the part file has the input position, the image the number of frames written before it
+            char name[PATH_MAX], part[PATH_MAX + 8];
+            snprintf(name, sizeof(name), s->target, t->index);
+            snprintf(part, sizeof(part), "%s.part", name);
+            snprintf(name, sizeof(name), s->target, (int)s->frames);
+            ok = rename(part, name) == 0;
+            break;
+        }
+        case SINK_RAW:
+            if(frame.data == NULL) {
+                return;
+            }
+            for(int y=0;y<frame.rows && ok;y++) {
+                ok = writeAll(s->fd, frame.ptr(y), (size_t)frame.cols * frame.elemSize());
+            }
+            break;
+        case SINK_VIDEO:
+            if(frame.data == NULL) {
+                return;
+            }
+            if(!s->writer.isOpened()) {
+                s->writer.open(s->target, CV_FOURCC('M','J','P','G'), s->fps, frame.size(), true);
+            }
+            ok = s->writer.isOpened();
+            if(ok) {
+                writeFrame(s->writer, frame);
+            }
+            break;
+        case SINK_SUM:
+            if(!t->written) {
+                return;
+            }
+            s->checksum = (s->checksum ^ t->hash) * FNV_PRIME;
+            break;
+        case SINK_NULL:
+            break;
+    }
+    if(ok) {
+        s->frames++;
+    } else {
+        fprintf(stderr, "Error writing frame %d to %s: %s\n", t->index, s->target, strerror(errno));
+        s->failures++;
+    }
+}
+
+// Finishes the sink and prints what it did; false if any frame failed
+bool sinkClose(FrameSink* s)
+{
+    if(s->fd >= 0 && close(s->fd) != 0) {
+        s->failures++;
+    }
+    s->fd = -1;
+    s->writer.release();
+    switch(s->kind) {
+        case SINK_SEQUENCE:
+        case SINK_RAW:
+        case SINK_VIDEO:
+            printf("Wrote %ld frames to %s\n", s->frames, s->target);
+            break;
+        case SINK_SUM:
+            printf("Checksum %016llx over %ld frames\n", (unsigned long long)s->checksum, s->frames);
+            break;
+        default:
+            break;
+    }
+    if(s->failures > 0) {
+        printf("%ld frames could not be written\n", s->failures);
+    }
+    return s->failures == 0;
+}
+#endif
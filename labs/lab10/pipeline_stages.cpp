@@ -0,0 +1,88 @@
+#ifndef PIPELINE_STAGES
+#define PIPELINE_STAGES
+/*
+ * The stages after the input, shared by pipeline_tbb and pipeline_bench,
+ * which only differ in where the frames come from.
+ *
+ *     filterStages()  brightness, contrast, rearrange and rotate as four
+ *                     parallel stages, or one fused stage
+ *     outputStages()  the sink's parallel stage, if it has one, and its
+ *                     serial in order stage, which puts the token back
+ *
+ * Each registers its stages with the PipelineStats when it is called, so
+ * call them in pipeline order, after the input stages. The filters pass
+ * frames that did not decode through untouched.
+ */
+#include <tbb/tbb.h>
+#include <tbb/pipeline.h>
+
+// The filter library's parallel loop hook, over bands of frame rows
+struct tbb_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        tbb::parallel_for (
+            tbb::blocked_range<int> ( begin, end, 16 ),
+            [&](const tbb::blocked_range<int>& r) { f(r.begin(), r.end()); });
+    }
+};
+
+// A parallel stage that runs filter on the token's frame, timed as stage
+template<typename Filter>
+tbb::filter_t<FrameToken*,FrameToken*> filterStage(FramePool* pool, PipelineStats* stats, int stage, const Filter& filter)
+{
+    return tbb::make_filter<FrameToken*,FrameToken*> (
+        tbb::filter::parallel,
+        [=](FrameToken* t) -> FrameToken* {
+            timedStage(stats, stage, t, [&]() {
+                if(tokenFrame(t).data)
+                    tokenFilter(pool, t, filter);
+            });
+            return t;
+        }
+    );
+}
+
+// brightness, contrast, rearrange and rotate: four stages, or one fused
+tbb::filter_t<FrameToken*,FrameToken*> filterStages(FramePool* pool, PipelineStats* stats, bool fused)
+{
+    if(fused) {
+        const int fusedStage = statsStage(stats, "fused", false);
+        return filterStage(pool, stats, fusedStage, [](Mat& in, Mat& out) { fusedUngarbleFilter(tbb_for(), in, out); });
+    }
+    const int brightStage = statsStage(stats, "brightness", false);
+    const int contrastStage = statsStage(stats, "contrast", false);
+    const int rearrangeStage = statsStage(stats, "rearrange", false);
+    const int rotateStage = statsStage(stats, "rotate", false);
+    return filterStage(pool, stats, brightStage, decreaseBrightnessFilter) &
+           filterStage(pool, stats, contrastStage, decreaseContrastFilter) &
+           filterStage(pool, stats, rearrangeStage, [](Mat& in, Mat& out) { rearrangePixelsFilter(tbb_for(), in, out); }) &
+           filterStage(pool, stats, rotateStage, rotateMatFilter);
+}
+
+// The sink: a serial in order stage, after a parallel one for the sinks that have one.
+// committed(t) runs in the serial stage after the frame is committed, before the token goes back.
+template<typename Committed>
+tbb::filter_t<FrameToken*,void> outputStages(FrameSink* sink, FramePool* pool, PipelineStats* stats, const Committed& committed)
+{
+    const int prepareStage = sinkParallel(sink) ? statsStage(stats, sinkPrepareName(sink), false) : -1;
+    const int commitStage = statsStage(stats, sinkCommitName(sink), true);
+    tbb::filter_t<FrameToken*,void> commit = tbb::make_filter<FrameToken*,void> (
+        tbb::filter::serial_in_order,
+        [=](FrameToken* t) {
+            timedStage(stats, commitStage, t, [&]() { sinkCommit(sink, t); });
+            committed(t);
+            t->uses++;
+            framePoolPut(pool, t);
+        }
+    );
+    if(prepareStage < 0)
+        return commit;
+    return tbb::make_filter<FrameToken*,FrameToken*> (
+        tbb::filter::parallel,
+        [=](FrameToken* t) -> FrameToken* {
+            timedStage(stats, prepareStage, t, [&]() { sinkPrepare(sink, t); });
+            return t;
+        }
+    ) & commit;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef PIPELINE_STATS
+#define PIPELINE_STATS
+/*
+ * Where a frame's time goes in the pipeline.
+ *
+ * Every stage is timed around its body: its service time, and the time the
+ * token waited since the previous stage finished with it (in TBB's queues,
+ * or behind a serial stage). The counts go to the worker's own StageTimes
+ * (enumerable_thread_specific), so stages never share a counter; they are
+ * summed when the pipeline is done. Each stage also notes how many tokens
+ * were in flight when it started, and the sink records every frame's
+ * latency from the start of its read to the end of its output stage.
+ *
+ * From the service times:
+ *     period   the time between frames once the pipeline is full: the
+ *              slowest serial stage, or all the work over the workers,
+ *              whichever is longer
+ *     tokens   a frame takes about the sum of the service times, so
+ *              keeping the period needs that over the period tokens in
+ *              flight (Little's law); statsAutoTokens() adds one for slack
+ *     latency  tokens beyond that only queue, so a frame's latency is
+ *              about tokens x period; statsLatencyTokens() gives the most
+ *              tokens that keep it under a target
+ */
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <tbb/enumerable_thread_specific.h>
+
+static const int MAX_STAGES = 8;
+
+// One worker's counts, per stage
+typedef struct _stageTimes {
+    long frames[MAX_STAGES];
+    double service[MAX_STAGES];
+    double wait[MAX_STAGES];
+    double maxService[MAX_STAGES];
+    long inFlight[MAX_STAGES];
+    int maxInFlight;
+
+    _stageTimes() { memset(this, 0, sizeof(*this)); }
+} StageTimes;
+
+typedef struct _pipelineStats {
+    int stages;
+    const char* names[MAX_STAGES];
+    bool serial[MAX_STAGES];
+    tbb::tick_count start;
+    tbb::enumerable_thread_specific<StageTimes> local;
+    tbb::atomic<int> inFlight;
+    std::vector<double> latency;    // per frame, seconds; negative until output
+    StageTimes total;               // summed by statsCollect()
+} PipelineStats;
+
+void statsInit(PipelineStats* s, int frames)
+{
+    s->stages = 0;
+    s->start = tbb::tick_count::now();
+    s->inFlight = 0;
+    s->latency.assign(frames, -1.0);
+}
+
+// Adds a stage, in pipeline order; returns its number
+int statsStage(PipelineStats* s, const char* name, bool serial)
+{
+    s->names[s->stages] = name;
+    s->serial[s->stages] = serial;
+    return s->stages++;
+}
+
+static inline double statsNow(const PipelineStats* s)
+{
+    return (tbb::tick_count::now() - s->start).seconds();
+}
+
+/**----------------------------------------------------------------------------
+ * Runs body() as stage on the token's frame. The first stage starts the
+ * token's clock and the last stops it. The latency is kept for frames
+ * 0..frames-1 of statsInit(); a video's frame count is only an estimate.
+ */
+template<typename Body>
+void timedStage(PipelineStats* s, int stage, FrameToken* t, const Body& body)
+{
+    const double begin = statsNow(s);
+    int inFlight = s->inFlight;
+    if(stage == 0) {
+        inFlight = ++s->inFlight;
+        t->begun = t->stageEnd = begin;
+    }
+    body();
+    const double end = statsNow(s);
+
+    StageTimes& l = s->local.local();
+    l.frames[stage]++;
+    l.service[stage] += end - begin;
+    l.wait[stage] += begin - t->stageEnd;
+    l.maxService[stage] = std::max(l.maxService[stage], end - begin);
+    l.inFlight[stage] += inFlight;
+    l.maxInFlight = std::max(l.maxInFlight, inFlight);
+    t->stageEnd = end;
+
+    if(stage == s->stages - 1) {
+        if(t->index >= 0 && t->index < (int)s->latency.size()) {
+            s->latency[t->index] = end - t->begun;
+        }
+        s->inFlight--;
+    }
+}
+
+// Sums the workers' counts into s->total
+void statsCollect(PipelineStats* s)
+{
+    StageTimes sum;
+    for(tbb::enumerable_thread_specific<StageTimes>::iterator it = s->local.begin(); it != s->local.end(); ++it) {
+        for(int i = 0; i < s->stages; i++) {
+            sum.frames[i] += it->frames[i];
+            sum.service[i] += it->service[i];
+            sum.wait[i] += it->wait[i];
+            sum.maxService[i] = std::max(sum.maxService[i], it->maxService[i]);
+            sum.inFlight[i] += it->inFlight[i];
+        }
+        sum.maxInFlight = std::max(sum.maxInFlight, it->maxInFlight);
+    }
+    s->total = sum;
+}
+
+static double statsMean(const StageTimes& t, const double* v, int stage)
+{
+    return t.frames[stage] > 0 ? v[stage] / t.frames[stage] : 0.0;
+}
+
+// Seconds a frame spends in service, summed over the stages
+double statsFrameTime(const PipelineStats* s)
+{
+    double sum = 0.0;
+    for(int i = 0; i < s->stages; i++) {
+        sum += statsMean(s->total, s->total.service, i);
+    }
+    return sum;
+}
+
+// Seconds between frames with the pipeline full; *bound is the stage that sets it, or -1 for the workers
+double statsPeriod(const PipelineStats* s, int workers, int* bound)
+{
+    double period = statsFrameTime(s) / workers;
+    *bound = -1;
+    for(int i = 0; i < s->stages; i++) {
+        const double service = statsMean(s->total, s->total.service, i);
+        if(s->serial[i] && service > period) {
+            period = service;
+            *bound = i;
+        }
+    }
+    return period;
+}
+
+// Tokens to keep the period: frame time over period, plus one, within [1, 2*workers]
+int statsAutoTokens(const PipelineStats* s, int workers)
+{
+    int bound;
+    const double period = statsPeriod(s, workers, &bound);
+    if(period <= 0.0) {
+        return workers;
+    }
+    const int tokens = (int)ceil(statsFrameTime(s) / period) + 1;
+    return std::max(1, std::min(tokens, 2 * workers));
+}
+
+// The most tokens that keep a frame's latency under seconds, at least 1
+int statsLatencyTokens(const PipelineStats* s, int workers, double seconds)
+{
+    int bound;
+    const double period = statsPeriod(s, workers, &bound);
+    if(period <= 0.0) {
+        return 1;
+    }
+    return std::max(1, (int)floor(seconds / period));
+}
+
+// Latency percentile p (0..100) of the frames output, in seconds
+double statsLatency(const PipelineStats* s, double p)
+{
+    std::vector<double> shown;
+    for(size_t i = 0; i < s->latency.size(); i++) {
+        if(s->latency[i] >= 0.0) {
+            shown.push_back(s->latency[i]);
+        }
+    }
+    if(shown.empty()) {
+        return 0.0;
+    }
+    std::sort(shown.begin(), shown.end());
+    const size_t k = (size_t)std::min((double)shown.size() - 1, floor(p / 100.0 * shown.size()));
+    return shown[k];
+}
+
+void statsReport(const PipelineStats* s, int workers)
+{
+    const StageTimes& t = s->total;
+    printf("%-11s %-9s %7s %11s %9s %9s %10s\n", "stage", "kind", "frames", "service ms", "wait ms", "max ms", "in flight");
+    for(int i = 0; i < s->stages; i++) {
+        printf("%-11s %-9s %7ld %11.3f %9.3f %9.3f %10.2f\n", s->names[i], s->serial[i] ? "serial" : "parallel",
+               t.frames[i], 1e3 * statsMean(t, t.service, i), 1e3 * statsMean(t, t.wait, i), 1e3 * t.maxService[i],
+               t.frames[i] > 0 ? (double)t.inFlight[i] / t.frames[i] : 0.0);
+    }
+    int bound;
+    const double period = statsPeriod(s, workers, &bound);
+    if(bound >= 0) {
+        printf("Bound by %s: %.3f ms per frame, serial\n", s->names[bound], 1e3 * period);
+    } else {
+        printf("Bound by the %d workers: %.3f ms of work per frame, %.3f ms per frame shared\n",
+               workers, 1e3 * statsFrameTime(s), 1e3 * period);
+    }
+    printf("Latency: p50 %.3f ms, p95 %.3f ms, max %.3f ms; at most %d tokens in flight\n",
+           1e3 * statsLatency(s, 50), 1e3 * statsLatency(s, 95), 1e3 * statsLatency(s, 100), t.maxInFlight);
+}
+
+// One row per stage; returns false if path cannot be written
+bool statsWriteCsv(const PipelineStats* s, const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if(f == NULL) {
+        return false;
+    }
+    const StageTimes& t = s->total;
+    fprintf(f, "stage,kind,frames,service_ms,wait_ms,max_service_ms,in_flight\n");
+    for(int i = 0; i < s->stages; i++) {
+        fprintf(f, "%s,%s,%ld,%.6f,%.6f,%.6f,%.4f\n", s->names[i], s->serial[i] ? "serial" : "parallel",
+                t.frames[i], 1e3 * statsMean(t, t.service, i), 1e3 * statsMean(t, t.wait, i), 1e3 * t.maxService[i],
+                t.frames[i] > 0 ? (double)t.inFlight[i] / t.frames[i] : 0.0);
+    }
+    return fclose(f) == 0;
+}
+#endif
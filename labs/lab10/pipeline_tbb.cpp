@@ -1,14 +1,52 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
+#include <algorithm>
+#include <climits>
 #include <iostream>
+#include <stdlib.h>
 #include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <tbb/tbb.h>
 #include <tbb/pipeline.h>
 
 using namespace cv;
 
+#include "pipeline_filters.cpp"
+#include "pipeline_pool.cpp"
+#include "pipeline_stats.cpp"
+#include "pipeline_sinks.cpp"
+#include "pipeline_stages.cpp"
+
+// Reads the frames from this video instead of image files (-i)
+static const char* videoInput = NULL;
+
+// Runs the four filters as one fused stage (-f)
+static bool fused = false;
+
+// Decodes in the input stage, as imread did, instead of in a parallel stage (-D)
+static bool serialDecode = false;
+
+// Tokens in flight (-n), 0 to pick them from the first frames (-n auto)
+static int tokenOption = 4;
+
+// Caps the tokens so a frame's latency stays under this many seconds (-L ms), 0 for no cap
+static double targetLatency = 0.0;
+
+// Per stage timing: printed with -s, written as CSV with -t file
+static bool stageSummary = false;
+static const char* stageCsv = NULL;
+
+// Where the frames go (-o), see pipeline_sinks.cpp
+static FrameSink sink;
+
+// Frames timed before -n auto or -L picks the tokens, at least
+static const int TUNE_FRAMES = 16;
+
 //----Method Declarations
-static void ungarbleVideo(char**,int);
+static bool ungarbleVideo(char**,int);
 //----END Method Declarations
 
 
@@ -17,10 +55,51 @@ static void ungarbleVideo(char**,int);
  */
 int main(int argc, char** argv)
 {
-   namedWindow("Nuclear Fusion",WINDOW_AUTOSIZE);
+   int opt;
+   bool badArgs = false;
+   const char* sinkSpec = "display";
+   while((opt = getopt(argc, argv, "i:fDn:L:st:o:")) != -1) {
+      switch(opt) {
+         case 'i': videoInput = optarg; break;
+         case 'f': fused = true; break;
+         case 'D': serialDecode = true; break;
+         case 'n':
+            tokenOption = std::string(optarg) == "auto" ? 0 : atoi(optarg);
+            badArgs = badArgs || (tokenOption < 1 && std::string(optarg) != "auto");
+            break;
+         case 'L':
+            targetLatency = atof(optarg) / 1000.0;
+            badArgs = badArgs || targetLatency <= 0.0;
+            break;
+         case 's': stageSummary = true; break;
+         case 't': stageCsv = optarg; break;
+         case 'o': sinkSpec = optarg; break;
+         default: badArgs = true;
+      }
+   }
+   badArgs = badArgs || (videoInput != NULL && optind < argc);
+   if(!badArgs && !sinkOpen(&sink, sinkSpec)) {
+      std::cerr << "Unknown output " << sinkSpec << "\n";
+      badArgs = true;
+   }
+   if(badArgs) {
+      std::cerr << "Usage: " << argv[0] << " [-f] [-D] [-n tokens|auto] [-L ms] [-s] [-t file.csv] [-o output] {-i video | frame...}\n"
+                << "  -i reads the frames from a video file instead of image files\n"
+                << "  -f runs the four filters as one fused stage\n"
+                << "  -D decodes frames in the serial input stage, for comparison\n"
+                << "  -n tokens in flight (default 4); auto picks them from the first frames' stage times\n"
+                << "  -L caps the tokens so a frame takes at most about ms from read to output\n"
+                << "  -s prints each stage's service and queue times, -t writes them as CSV\n"
+                << "  -o display (default), seq:dir/frame_%05d.png, raw:file or raw:- for stdout,\n"
+                << "     video:file.avi, sum or null\n";
+      return 1;
+   }
+   if(sink.kind == SINK_DISPLAY)
+      namedWindow("Nuclear Fusion",WINDOW_AUTOSIZE);
    
-	ungarbleVideo(argv+1,argc-1);//argv+1 is "all of the arguments except the executable name." C is weird
-	return 0;
+	bool ok = ungarbleVideo(argv+optind,argc-optind);//the arguments after the options
+	ok = sinkClose(&sink) && ok;
+	return ok ? 0 : 1;
 }
 
 
@@ -32,55 +111,51 @@ void readFrame(VideoCapture &input_cap, Mat& readFrame, int *outOfFrames)
 }
 
 
-//filter to decrease the contrast
-void decreaseContrastFilter(Mat &inFrame, Mat &outFrame) 
+// Reads the file at path into bytes, keeping the vector's buffer when it is big enough
+bool readFile(const char* path, std::vector<uchar>& bytes)
 {
-	//decrease the contrast 1/1.025
-	inFrame.convertTo(outFrame, -1, .975, 0); 
-} //END decreaseContrastFilter
-
-
-//filter to decrease the brightness
-void decreaseBrightnessFilter(Mat &frame, Mat &outFrame)
-{				
-		//decrease the brightness by 100 units
-		outFrame =  frame - Scalar(100, 100, 100); 
-} //END decreaseBrightnessFilter
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	size_t got = 0;
+	if(fstat(fd, &st) == 0) {
+		bytes.resize(st.st_size);
+		while(got < bytes.size()) {
+			ssize_t n = read(fd, &bytes[got], bytes.size() - got);
+			if(n <= 0)
+				break;
+			got += n;
+		}
+	}
+	close(fd);
+	bytes.resize(got);
+	return got > 0;
+} //END readFile()
 
 
-//filter to rotate a frame
-void rotateMatFilter(Mat &frame, Mat &outFrame) 
+// Asks the kernel to start reading the file at path into the page cache
+void prefetchFile(const char* path)
 {
-	int iAngle = 340;
-	Mat matRotation = getRotationMatrix2D(Point(frame.cols/2, frame.rows/2), (iAngle-180), 1);	 
-	warpAffine( frame, outFrame, matRotation, frame.size());
-			
-} //END rotateMatFilter()
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+} //END prefetchFile()
 
 
-//filter to rearange the pixels in a frame
-void rearrangePixelsFilter(Mat &frame, Mat &outFrame) 
+// Decodes the token's file bytes into its frame; the frame is left empty if they do not decode
+void decodeToken(FramePool* pool, FrameToken* t, char** imgList)
 {
-	outFrame = frame.clone();
-		for (int y = 0; y < frame.rows; y++) {
-			for (int x = 0; x < frame.cols; x++) {
-				int r, g, b;
-				r = frame.at<cv::Vec3b>((y+375)%(outFrame.rows),(x+475)%(outFrame.cols))[0];
-				g = frame.at<cv::Vec3b>((y+375)%(outFrame.rows),(x+475)%(outFrame.cols))[1];
-				b = frame.at<cv::Vec3b>((y+375)%(outFrame.rows),(x+475)%(outFrame.cols))[2];
-				outFrame.at<cv::Vec3b>(y,x)[0] = g;
-				outFrame.at<cv::Vec3b>(y,x)[1] = b;
-				outFrame.at<cv::Vec3b>(y,x)[2] = r;
-			}
-		}	
-} //END rearangePixelsFilter()
-
-
-//function to write a frame
-void writeFrame(VideoWriter &output_cap, Mat &outFrame)
-{
-	output_cap.write(outFrame);
-} //END writeFrame()
+	Mat& frame = tokenFrame(t);
+	const FrameBefore before = frameBefore(frame);
+	if(t->bytes.empty() || !imdecode(t->bytes, CV_LOAD_IMAGE_COLOR, &frame).data) {
+		std::cerr << "Error opening " << imgList[t->index] << std::endl;
+		frame.release();
+	}
+	framePoolCount(pool, t, before, frame);
+} //END decodeToken()
 
 
 /**----------------------------------------------------------------------------
@@ -98,62 +173,149 @@ void writeFrame(VideoWriter &output_cap, Mat &outFrame)
 void debug()
 {
 }
-void ungarbleVideo(char** imgList, int numImgs) 
+bool ungarbleVideo(char** imgList, int numImgs) 
 {
     int imgNum = 0;
-    size_t ntoken = 4;
-    
-    tbb::parallel_pipeline (
-        ntoken,
-        tbb::make_filter<void,Mat>(
-            tbb::filter::serial_in_order,
-            [&]( tbb::flow_control& fc ) -> Mat {
-                Mat pframe = imread(imgList[imgNum++],CV_LOAD_IMAGE_COLOR);
-                if (imgNum == numImgs) { fc.stop(); }
-                return pframe;
-            }
-        ) &
-        tbb::make_filter<Mat,Mat> (
-            tbb::filter::parallel,
-            [](Mat pframe) -> Mat { 
-                Mat filter_frame;
-                decreaseBrightnessFilter(pframe, filter_frame);
-                return filter_frame;
-            }
-        ) &
-        tbb::make_filter<Mat,Mat> (
-            tbb::filter::parallel,
-            [](Mat pframe) -> Mat { 
-                Mat filter_frame;
-                decreaseContrastFilter(pframe, filter_frame);
-                return filter_frame;
-            }
-        ) &
-        tbb::make_filter<Mat,Mat> (
-            tbb::filter::parallel,
-            [](Mat pframe) -> Mat { 
-                Mat filter_frame;
-                rearrangePixelsFilter(pframe, filter_frame);
-                return filter_frame;
-            }
-        ) &
-        tbb::make_filter<Mat,Mat> (
-            tbb::filter::parallel,
-            [](Mat pframe) -> Mat { 
-                Mat filter_frame;
-                rotateMatFilter(pframe, filter_frame);
-                return filter_frame;
-            }
-        ) &
-        tbb::make_filter<Mat,void> (
+    int outOfFrames = 0;
+    const int workers = tbb::task_scheduler_init::default_num_threads();
+
+    // a video is decoded as it is read, one frame after another; its frame count is only a hint
+    const bool video = videoInput != NULL;
+    VideoCapture cap;
+    // OpenCV 2.x's read() points its Mat at the capture's own buffer, which the next read overwrites,
+    // so each frame is read here and copied into its token's pooled buffer
+    Mat captured;
+    if (video) {
+        if (!cap.open(videoInput)) {
+            std::cerr << "Error opening " << videoInput << std::endl;
+            return false;
+        }
+        numImgs = std::max(0, (int)cap.get(CV_CAP_PROP_FRAME_COUNT));
+        if (cap.get(CV_CAP_PROP_FPS) > 0)
+            sink.fps = cap.get(CV_CAP_PROP_FPS);
+    }
+
+    const bool tune = tokenOption == 0 || targetLatency > 0.0;
+    size_t ntoken = tokenOption > 0 ? tokenOption : workers;
+
+    // each token in flight carries its buffers from the input stage to the sink
+    FramePool pool;
+    framePoolInit(&pool, tune ? std::max((int)ntoken, 2*workers) : ntoken);
+
+    // every stage is timed on the worker that runs it
+    PipelineStats stats;
+    statsInit(&stats, numImgs);
+    const int readStage = statsStage(&stats, video ? "capture" : "read", true);
+    const int decodeStage = video ? -1 : statsStage(&stats, "decode", false);
+    // the filters and the sink (pipeline_stages.cpp), after the input stages
+    tbb::filter_t<FrameToken*,FrameToken*> filters = filterStages(&pool, &stats, fused);
+    tbb::filter_t<FrameToken*,void> output = outputStages(&sink, &pool, &stats, [](FrameToken*) {});
+
+    // Runs frames imgNum..last-1 (or to the end of the video) through the pipeline with tokens in flight
+    auto run = [&](size_t tokens, int last) {
+        // the kernel reads ahead as many files as there are tokens, so the input stage mostly copies from memory
+        for (int i = imgNum; !video && i < last && i < imgNum + (int)tokens; i++)
+            prefetchFile(imgList[i]);
+
+        // the video's next frame, decoded by the capture and copied into the token's buffer
+        tbb::filter_t<void,FrameToken*> capture = tbb::make_filter<void,FrameToken*>(
             tbb::filter::serial_in_order,
-            [](Mat pframe) {
-              imshow("Nuclear Fusion",pframe);
-              waitKey(1);
-              return;
+            [&]( tbb::flow_control& fc ) -> FrameToken* {
+                if (imgNum == last || outOfFrames) {
+                    fc.stop();
+                    return NULL;
+                }
+                FrameToken* t = framePoolGet(&pool);
+                t->index = imgNum;
+                timedStage(&stats, readStage, t, [&]() {
+                    readFrame(cap, captured, &outOfFrames);
+                    if (!outOfFrames) {
+                        const FrameBefore before = frameBefore(tokenFrame(t));
+                        captured.copyTo(tokenFrame(t));
+                        framePoolCount(&pool, t, before, tokenFrame(t));
+                    }
+                });
+                if (outOfFrames) {
+                    // the end of the video: the token goes through empty, as a frame that did not decode
+                    tokenFrame(t).release();
+                    t->index = -1;
+                } else {
+                    imgNum++;
+                }
+                return t;
             }
-        )
-    );
-}
+        );
+
+        tbb::parallel_pipeline (
+            tokens,
+            video ? capture & filters & output :
+            tbb::make_filter<void,FrameToken*>(
+                tbb::filter::serial_in_order,
+                [&]( tbb::flow_control& fc ) -> FrameToken* {
+                    if (imgNum == last) {
+                        fc.stop();
+                        return NULL;
+                    }
+                    if (imgNum + (int)tokens < last)
+                        prefetchFile(imgList[imgNum + tokens]);
+                    // never empty: the pipeline has at most tokens <= pool.size out
+                    FrameToken* t = framePoolGet(&pool);
+                    t->index = imgNum;
+                    timedStage(&stats, readStage, t, [&]() {
+                        const size_t capacity = t->bytes.capacity();
+                        const void* before = t->bytes.data();
+                        if (!readFile(imgList[imgNum++], t->bytes))
+                            t->bytes.clear();
+                        framePoolCountBytes(&pool, t, capacity, before, t->bytes);
+                        if (serialDecode)
+                            decodeToken(&pool, t, imgList);
+                    });
+                    return t;
+                }
+            ) &
+            tbb::make_filter<FrameToken*,FrameToken*> (
+                tbb::filter::parallel,
+                [&](FrameToken* t) -> FrameToken* {
+                    timedStage(&stats, decodeStage, t, [&]() {
+                        if (!serialDecode)
+                            decodeToken(&pool, t, imgList);
+                    });
+                    return t;
+                }
+            ) &
+            filters &
+            output
+        );
+    };
 
+    tbb::tick_count start = tbb::tick_count::now();
+    if (tune) {
+        // time the first frames, then pick the tokens for the rest from their stage times
+        const int tuneFrames = std::max(TUNE_FRAMES, 2*workers);
+        run(ntoken, video ? tuneFrames : std::min(numImgs, tuneFrames));
+        statsCollect(&stats);
+        if (tokenOption == 0)
+            ntoken = statsAutoTokens(&stats, workers);
+        if (targetLatency > 0.0)
+            ntoken = std::min((int)ntoken, statsLatencyTokens(&stats, workers, targetLatency));
+        int bound;
+        printf("Timed %d frames: %.3f ms of work and %.3f ms between frames, so %d tokens",
+               imgNum, 1e3 * statsFrameTime(&stats), 1e3 * statsPeriod(&stats, workers, &bound), (int)ntoken);
+        if (targetLatency > 0.0)
+            printf(" (for at most %.1f ms from read to output)", 1e3 * targetLatency);
+        printf("\n");
+    }
+    run(ntoken, video ? INT_MAX : numImgs);
+    const double seconds = (tbb::tick_count::now() - start).seconds();
+    statsCollect(&stats);
 
+    printf("%d frames in %.3f s, %.1f fps (decoding %s)\n", imgNum, seconds, imgNum / seconds,
+           video ? "the video in the input stage" : serialDecode ? "in the input stage" : "in parallel");
+    if (stageSummary)
+        statsReport(&stats, workers);
+    if (stageCsv != NULL && !statsWriteCsv(&stats, stageCsv))
+        std::cerr << "Error writing " << stageCsv << std::endl;
+    framePoolReport(&pool, imgNum);
+    framePoolFree(&pool);
+    return true;
+}
@@ -0,0 +1,333 @@
+/*
+ * The scans in scan_kernels.cpp against std::partial_sum, in place on n
+ * ints for n = 1000, 10000, ... up to maxElements:
+ *     partial_sum     std::partial_sum, serially
+ *     chunk           scanChunk() on one thread (SSE2 when built with it)
+ *     parallel_scan   scanTbb()
+ *     blocked tbb     scanBlocked() over tbb::parallel_for
+ *     blocked omp     scanBlocked() over an OpenMP parallel region
+ *     blocked cilk    scanBlocked() over cilk_for, when built with Cilk
+ * and the many short vectors of scanGroup(), SEGMENT ints each, end to end:
+ *     per vector      a serial scan of each vector, as scanGroup() does
+ *     segmented tbb   scanSegmented() over tbb::parallel_for
+ *     segmented omp   scanSegmented() over an OpenMP parallel region
+ * and batches of vectors in CSR form, up to BATCH_ELEMENTS ints, with the
+ * vector lengths drawn from each of batchShapes (fixed, uniform, mostly
+ * ones with a few long vectors, one vector):
+ *     per vector      each vector scanned serially, the vectors split over
+ *                     an OpenMP parallel for, as scanGroup() does
+ *     batch tbb       scanBatch() over tbb::parallel_for
+ *     batch omp       scanBatch() over an OpenMP parallel region
+ * Every result, inclusive and exclusive, is checked element by element
+ * against the values it was made from. Sizes that need more than
+ * MEMORY_SHARE of the physical memory are skipped.
+ *
+ *     ./scan_bench [maxElements]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <numeric>
+#include <vector>
+#include <omp.h>
+#include <tbb/tbb.h>
+#ifdef __cilk
+#include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
+#endif
+
+#include "scan_kernels.cpp"
+
+// scanGroup()'s NUMELEMENTS
+static const int SEGMENT = 8;
+
+// Most elements in a batch
+static const double BATCH_ELEMENTS = 1e8;
+
+// Largest share of the physical memory a size may use
+static const double MEMORY_SHARE = 0.75;
+
+struct tbb_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        tbb::parallel_for(tbb::blocked_range<int>(begin, end), [&](const tbb::blocked_range<int>& r) {
+            f(r.begin(), r.end());
+        });
+    }
+};
+
+// One contiguous run of the blocks per thread
+struct omp_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        #pragma omp parallel
+        {
+            const int t = omp_get_thread_num(), n = omp_get_num_threads();
+            const int b = begin + (int)((long)(end - begin) * t / n);
+            const int e = begin + (int)((long)(end - begin) * (t + 1) / n);
+            if(b < e) {
+                f(b, e);
+            }
+        }
+    }
+};
+
+#ifdef __cilk
+struct cilk_for_range {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        cilk_for(int k = begin; k < end; ++k) {
+            f(k, k + 1);
+        }
+    }
+};
+#endif
+
+// Element i of the input: -1, 0 or 1, so no prefix sum overflows
+static inline int32_t value(size_t i)
+{
+    return (int32_t)((uint32_t)(i * 2654435761u) % 3) - 1;
+}
+
+static void fill(int32_t* a, size_t n)
+{
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, SCAN_MIN_BLOCK), [&](const tbb::blocked_range<size_t>& r) {
+        for(size_t i=r.begin();i<r.end();i++) {
+            a[i] = value(i);
+        }
+    });
+}
+
+// Whether a holds the scan of value(0..n), restarting every segment elements (0 for none)
+static bool check(const int32_t* a, size_t n, bool inclusive, size_t segment)
+{
+    int64_t sum = 0;
+    for(size_t i=0;i<n;i++) {
+        if(segment > 0 && i % segment == 0) {
+            sum = 0;
+        }
+        if(inclusive) {
+            sum += value(i);
+        }
+        if(a[i] != sum) {
+            return false;
+        }
+        if(!inclusive) {
+            sum += value(i);
+        }
+    }
+    return true;
+}
+
+// Whether a holds the scan of value(offsets[0]..offsets[count]), restarting at every offset
+static bool checkBatch(const int32_t* a, const std::vector<size_t>& offsets, bool inclusive)
+{
+    for(size_t v=0;v+1<offsets.size();v++) {
+        int64_t sum = 0;
+        for(size_t i=offsets[v];i<offsets[v+1];i++) {
+            if(inclusive) {
+                sum += value(i);
+            }
+            if(a[i] != sum) {
+                return false;
+            }
+            if(!inclusive) {
+                sum += value(i);
+            }
+        }
+    }
+    return true;
+}
+
+typedef struct _batchShape {
+    const char* name;
+    size_t (*length)(size_t v);   // length of vector v
+} BatchShape;
+
+// A cheap hash of v, for lengths that look random but are the same every run
+static inline uint32_t mix(size_t v)
+{
+    uint32_t h = (uint32_t)v * 2654435761u;
+    return h ^ (h >> 15);
+}
+
+static size_t fixedLength(size_t) { return SEGMENT; }
+static size_t uniformLength(size_t v) { return 1 + mix(v) % 64; }
+// nine in ten vectors of one element, the rest up to 4096 long
+static size_t skewedLength(size_t v) { return mix(v) % 10 != 0 ? 1 : 1 + mix(v + 1) % 4096; }
+static size_t wholeLength(size_t) { return (size_t)-1; }
+
+static const BatchShape batchShapes[] = {
+    { "fixed 8", fixedLength },
+    { "uniform 1-64", uniformLength },
+    { "skewed", skewedLength },
+    { "one vector", wholeLength },
+};
+
+// Offsets of vectors of shape's lengths covering exactly n elements
+static std::vector<size_t> batchOffsets(const BatchShape& shape, size_t n)
+{
+    std::vector<size_t> offsets(1, 0);
+    for(size_t v=0;offsets.back()<n;v++) {
+        offsets.push_back(std::min(n, offsets.back() + shape.length(v)));
+    }
+    return offsets;
+}
+
+typedef struct _scanTimes {
+    double inclusive;
+    double exclusive;
+    bool ok;
+} ScanTimes;
+
+// Times scan(a, n, inclusive) both ways, in place, and checks it
+template<typename Scan>
+ScanTimes timeScan(std::vector<int32_t>& a, size_t segment, const Scan& scan)
+{
+    ScanTimes t;
+    fill(a.data(), a.size());
+    double start = omp_get_wtime();
+    scan(a.data(), a.size(), true);
+    t.inclusive = omp_get_wtime() - start;
+    t.ok = check(a.data(), a.size(), true, segment);
+
+    fill(a.data(), a.size());
+    start = omp_get_wtime();
+    scan(a.data(), a.size(), false);
+    t.exclusive = omp_get_wtime() - start;
+    t.ok = t.ok && check(a.data(), a.size(), false, segment);
+    return t;
+}
+
+// timeScan() for a batch: scan(a, inclusive) scans the vectors at offsets
+template<typename Scan>
+ScanTimes timeBatch(std::vector<int32_t>& a, const std::vector<size_t>& offsets, const Scan& scan)
+{
+    ScanTimes t;
+    fill(a.data(), a.size());
+    double start = omp_get_wtime();
+    scan(a.data(), true);
+    t.inclusive = omp_get_wtime() - start;
+    t.ok = checkBatch(a.data(), offsets, true);
+
+    fill(a.data(), a.size());
+    start = omp_get_wtime();
+    scan(a.data(), false);
+    t.exclusive = omp_get_wtime() - start;
+    t.ok = t.ok && checkBatch(a.data(), offsets, false);
+    return t;
+}
+
+static void report(size_t n, const char* name, const ScanTimes& t, double baseline, bool* pass)
+{
+    printf("%12zu  %-14s %9.3f %9.3f %8.2f %8.2fx  %s\n", n, name, 1e3 * t.inclusive, 1e3 * t.exclusive,
+           n / t.inclusive / 1e9, baseline / t.inclusive, t.ok ? "ok" : "WRONG");
+    *pass = *pass && t.ok;
+}
+
+int main(int argc, char** argv)
+{
+    const double maxElements = argc > 1 ? atof(argv[1]) : 1e9;
+    if(maxElements < 1000) {
+        printf("Usage: %s [maxElements]\n", argv[0]);
+        return 1;
+    }
+    const double memory = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    const int tbbWorkers = tbb::task_scheduler_init::default_num_threads();
+    const int ompWorkers = omp_get_max_threads();
+    printf("%d TBB workers, %d OpenMP threads", tbbWorkers, ompWorkers);
+#ifdef __cilk
+    const int cilkWorkers = __cilkrts_get_nworkers();
+    printf(", %d Cilk workers", cilkWorkers);
+#endif
+#ifdef __SSE2__
+    printf(", SSE2 chunks");
+#endif
+    printf("\n%12s  %-14s %9s %9s %8s %9s\n", "elements", "engine", "incl ms", "excl ms", "Gelem/s", "speedup");
+
+    bool pass = true;
+    for(double size=1000;size<=maxElements;size*=10) {
+        const size_t n = (size_t)size;
+        if(n * (sizeof(int32_t) + 1) > MEMORY_SHARE * memory) {
+            printf("%12zu  skipped, needs %.1f GB\n", n, n * (sizeof(int32_t) + 1) / 1e9);
+            continue;
+        }
+        std::vector<int32_t> a(n);
+
+        const ScanTimes serial = timeScan(a, 0, [](int32_t* p, size_t m, bool inclusive) {
+            if(inclusive) {
+                std::partial_sum(p, p + m, p);
+            } else {
+                // shift right by one as it goes, which partial_sum cannot do in place
+                int32_t sum = 0;
+                for(size_t i=0;i<m;i++) {
+                    const int32_t x = p[i];
+                    p[i] = sum;
+                    sum += x;
+                }
+            }
+        });
+        report(n, "partial_sum", serial, serial.inclusive, &pass);
+        report(n, "chunk", timeScan(a, 0, [](int32_t* p, size_t m, bool inclusive) {
+            scanChunk(p, p, m, 0, inclusive);
+        }), serial.inclusive, &pass);
+        report(n, "parallel_scan", timeScan(a, 0, [](int32_t* p, size_t m, bool inclusive) {
+            scanTbb(p, p, m, inclusive);
+        }), serial.inclusive, &pass);
+        report(n, "blocked tbb", timeScan(a, 0, [&](int32_t* p, size_t m, bool inclusive) {
+            scanBlocked(tbb_for(), p, p, m, inclusive, scanBlocks(m, tbbWorkers));
+        }), serial.inclusive, &pass);
+        report(n, "blocked omp", timeScan(a, 0, [&](int32_t* p, size_t m, bool inclusive) {
+            scanBlocked(omp_for(), p, p, m, inclusive, scanBlocks(m, ompWorkers));
+        }), serial.inclusive, &pass);
+#ifdef __cilk
+        report(n, "blocked cilk", timeScan(a, 0, [&](int32_t* p, size_t m, bool inclusive) {
+            scanBlocked(cilk_for_range(), p, p, m, inclusive, scanBlocks(m, cilkWorkers));
+        }), serial.inclusive, &pass);
+#endif
+
+        std::vector<uint8_t> heads(n);
+        for(size_t i=0;i<n;i++) {
+            heads[i] = i % SEGMENT == 0;
+        }
+        const ScanTimes perVector = timeScan(a, SEGMENT, [](int32_t* p, size_t m, bool inclusive) {
+            for(size_t v=0;v<m;v+=SEGMENT) {
+                scanChunk<int32_t>(p + v, p + v, std::min((size_t)SEGMENT, m - v), 0, inclusive);
+            }
+        });
+        report(n, "per vector", perVector, perVector.inclusive, &pass);
+        report(n, "segmented tbb", timeScan(a, SEGMENT, [&](int32_t* p, size_t m, bool inclusive) {
+            scanSegmented(tbb_for(), p, heads.data(), p, m, inclusive, scanBlocks(m, tbbWorkers));
+        }), perVector.inclusive, &pass);
+        report(n, "segmented omp", timeScan(a, SEGMENT, [&](int32_t* p, size_t m, bool inclusive) {
+            scanSegmented(omp_for(), p, heads.data(), p, m, inclusive, scanBlocks(m, ompWorkers));
+        }), perVector.inclusive, &pass);
+    }
+
+    const size_t batch = (size_t)std::min(maxElements, BATCH_ELEMENTS);
+    if(batch * (sizeof(int32_t) + sizeof(size_t)) > MEMORY_SHARE * memory) {
+        printf("batches skipped, need %.1f GB\n", batch * (sizeof(int32_t) + sizeof(size_t)) / 1e9);
+    } else {
+        std::vector<int32_t> a(batch);
+        printf("\n%12s  %-14s %9s %9s %8s %9s\n", "elements", "engine", "incl ms", "excl ms", "Gelem/s", "speedup");
+        for(size_t s=0;s<sizeof(batchShapes)/sizeof(batchShapes[0]);s++) {
+            const std::vector<size_t> offsets = batchOffsets(batchShapes[s], batch);
+            const size_t count = offsets.size() - 1;
+            printf("%12s  %zu vectors, %s\n", "", count, batchShapes[s].name);
+
+            const ScanTimes perVector = timeBatch(a, offsets, [&](int32_t* p, bool inclusive) {
+                #pragma omp parallel for schedule(static)
+                for(long v=0;v<(long)count;v++) {
+                    scanChunk<int32_t>(p + offsets[v], p + offsets[v], offsets[v+1] - offsets[v], 0, inclusive);
+                }
+            });
+            report(batch, "per vector", perVector, perVector.inclusive, &pass);
+            report(batch, "batch tbb", timeBatch(a, offsets, [&](int32_t* p, bool inclusive) {
+                scanBatch(tbb_for(), offsets.data(), count, p, p, inclusive, scanBlocks(batch, tbbWorkers));
+            }), perVector.inclusive, &pass);
+            report(batch, "batch omp", timeBatch(a, offsets, [&](int32_t* p, bool inclusive) {
+                scanBatch(omp_for(), offsets.data(), count, p, p, inclusive, scanBlocks(batch, ompWorkers));
+            }), perVector.inclusive, &pass);
+        }
+    }
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
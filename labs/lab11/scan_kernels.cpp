@@ -0,0 +1,425 @@
+#ifndef SCAN_KERNELS
+#define SCAN_KERNELS
+/*
+ * Prefix sums (scans) that are right by construction.
+ *
+ * tbbNotQuiteRight's Scanner runs input[i] = input[i-1] + input[i] inside
+ * a parallel_for: a chunk reads the end of the chunk before it while that
+ * chunk may still be writing it, and i <= range.end() runs one past the
+ * range. A parallel scan has to pass each chunk the sum of everything
+ * before it instead:
+ *
+ *     scanChunk()     one chunk, serially, starting from a carry; with SSE2
+ *                     the int32_t and int64_t versions scan four or two values
+ *                     in a register (two shift-and-adds) and add the carry
+ *     scanBlocked()   two passes over fixed blocks with the program's pfor:
+ *                     each block's sum, the sums scanned serially, then each
+ *                     block scanned from the sum of the blocks before it.
+ *                     Every block writes only its own elements.
+ *     scanTbb()       tbb::parallel_scan, whose body sums a range when it
+ *                     only looks ahead and scans it when it has the carry
+ *     scanSegmented() the same two passes, restarting the sum at every
+ *                     element whose head flag is set, for many short vectors
+ *                     laid end to end (scanGroup()'s case)
+ *     scanBatch()     the same for vectors given by CSR offsets, with the
+ *                     blocks split by elements, not vectors
+ *
+ * inclusive: out[i] = in[0] + ... + in[i]; exclusive: out[i] = in[0] + ...
+ * + in[i-1], and out[0] = 0. out may be in. The block sums change the order
+ * of the additions, so float results can differ from a serial scan in the
+ * last bits; integer results cannot.
+ *
+ * Blocks are split with the program's parallel loop functor
+ *     pfor(begin, end, f)  calls f(b, e) on disjoint sub-ranges covering [begin, end)
+ */
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_scan.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Fewest elements worth a block (or a parallel_scan range) of their own
+static const size_t SCAN_MIN_BLOCK = 16384;
+
+// Blocks per worker for scanBlocked(), so a slow worker does not hold up the pass
+static const int SCAN_BLOCKS_PER_WORKER = 4;
+
+// Blocks for n elements on workers workers; one worker scans in one block, in one pass
+int scanBlocks(size_t n, int workers)
+{
+    if(workers <= 1) {
+        return 1;
+    }
+    const size_t most = (n + SCAN_MIN_BLOCK - 1) / SCAN_MIN_BLOCK;
+    return (int)std::max((size_t)1, std::min(most, (size_t)(SCAN_BLOCKS_PER_WORKER * workers)));
+}
+
+// Sum of in[0..n)
+template<typename T>
+T scanSum(const T* in, size_t n)
+{
+    T sum = T();
+    for(size_t i=0;i<n;i++) {
+        sum += in[i];
+    }
+    return sum;
+}
+
+// Scans in[0..n) into out starting from carry; returns carry plus the sum
+template<typename T>
+T scanChunk(const T* in, T* out, size_t n, T carry, bool inclusive)
+{
+    for(size_t i=0;i<n;i++) {
+        const T x = in[i];
+        if(!inclusive) {
+            out[i] = carry;
+        }
+        carry += x;
+        if(inclusive) {
+            out[i] = carry;
+        }
+    }
+    return carry;
+}
+
+#ifdef __SSE2__
+static inline int32_t scanSum(const int32_t* in, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)(in + i)));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    int32_t sum = _mm_cvtsi128_si32(acc);
+    for(; i < n; i++) {
+        sum += in[i];
+    }
+    return sum;
+}
+
+static inline int32_t scanChunk(const int32_t* in, int32_t* out, size_t n, int32_t carry, bool inclusive)
+{
+    __m128i c = _mm_set1_epi32(carry);
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+        // x0, x0+x1, x1+x2, x2+x3, then x0, x0+x1, x0+x1+x2, x0+x1+x2+x3
+        __m128i v = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        v = _mm_add_epi32(_mm_add_epi32(v, _mm_slli_si128(v, 8)), c);
+        _mm_storeu_si128((__m128i*)(out + i), inclusive ? v : _mm_sub_epi32(v, x));
+        c = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    return scanChunk<int32_t>(in + i, out + i, n - i, _mm_cvtsi128_si32(c), inclusive);
+}
+
+static inline int64_t scanSum(const int64_t* in, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+        acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)(in + i)));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    int64_t sum = _mm_cvtsi128_si64(acc);
+    for(; i < n; i++) {
+        sum += in[i];
+    }
+    return sum;
+}
+
+static inline int64_t scanChunk(const int64_t* in, int64_t* out, size_t n, int64_t carry, bool inclusive)
+{
+    __m128i c = _mm_set1_epi64x(carry);
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+        const __m128i v = _mm_add_epi64(_mm_add_epi64(x, _mm_slli_si128(x, 8)), c);
+        _mm_storeu_si128((__m128i*)(out + i), inclusive ? v : _mm_sub_epi64(v, x));
+        c = _mm_unpackhi_epi64(v, v);
+    }
+    return scanChunk<int64_t>(in + i, out + i, n - i, _mm_cvtsi128_si64(c), inclusive);
+}
+#endif
+
+// First element of block k of blocks over n elements
+static inline size_t scanBlockStart(size_t n, int blocks, int k)
+{
+    return (size_t)((unsigned long long)n * k / blocks);
+}
+
+/**----------------------------------------------------------------------------
+ * Scans in[0..n) into out in blocks (scanBlocks()) with pfor: the blocks'
+ * sums, their exclusive scan, then every block from the sum before it.
+ */
+template<typename ParallelFor, typename T>
+void scanBlocked(const ParallelFor& pfor, const T* in, T* out, size_t n, bool inclusive, int blocks)
+{
+    if(blocks <= 1) {
+        scanChunk(in, out, n, T(), inclusive);
+        return;
+    }
+    std::vector<T> sums(blocks + 1, T());
+    pfor(0, blocks, [&](int b, int e) {
+        for(int k=b;k<e;k++) {
+            const size_t lo = scanBlockStart(n, blocks, k), hi = scanBlockStart(n, blocks, k+1);
+            sums[k+1] = scanSum(in + lo, hi - lo);
+        }
+    });
+    for(int k=0;k<blocks;k++) {
+        sums[k+1] += sums[k];
+    }
+    pfor(0, blocks, [&](int b, int e) {
+        for(int k=b;k<e;k++) {
+            const size_t lo = scanBlockStart(n, blocks, k), hi = scanBlockStart(n, blocks, k+1);
+            scanChunk(in + lo, out + lo, hi - lo, sums[k], inclusive);
+        }
+    });
+} //END scanBlocked()
+
+
+// parallel_scan's body: a pre-scan only sums its range, a final scan scans it from the sum before it
+template<typename T>
+class ScanBody {
+    T sum;
+    const T* in;
+    T* out;
+    bool inclusive;
+public:
+    ScanBody(const T* in, T* out, bool inclusive) : sum(), in(in), out(out), inclusive(inclusive) {}
+    ScanBody(ScanBody& b, tbb::split) : sum(), in(b.in), out(b.out), inclusive(b.inclusive) {}
+    template<typename Tag>
+    void operator()(const tbb::blocked_range<size_t>& r, Tag) {
+        if(Tag::is_final_scan()) {
+            sum = scanChunk(in + r.begin(), out + r.begin(), r.size(), sum, inclusive);
+        } else {
+            sum += scanSum(in + r.begin(), r.size());
+        }
+    }
+    void reverse_join(ScanBody& a) { sum = a.sum + sum; }
+    void assign(ScanBody& b) { sum = b.sum; }
+    T total() const { return sum; }
+};
+
+// Scans in[0..n) into out with tbb::parallel_scan; returns the sum
+template<typename T>
+T scanTbb(const T* in, T* out, size_t n, bool inclusive)
+{
+    ScanBody<T> body(in, out, inclusive);
+    tbb::parallel_scan(tbb::blocked_range<size_t>(0, n, SCAN_MIN_BLOCK), body);
+    return body.total();
+}
+
+
+/**----------------------------------------------------------------------------
+ * Segmented scans. heads[i] is nonzero where a vector starts; the sum
+ * restarts at every head, as if each vector were scanned alone. The chunk
+ * scan looks at SCAN_WINDOW heads at a time: a window without a head is
+ * scanned with scanChunk(), one with heads an element at a time, so long
+ * vectors scan about as fast as one and short ones pay no search.
+ */
+// Heads looked at together: two 64 bit words
+static const size_t SCAN_WINDOW = 16;
+
+// Scans in[0..n) from carry, restarting at heads; returns the sum since the last head
+template<typename T>
+T scanSegmentedChunk(const T* in, const uint8_t* heads, T* out, size_t n, T carry, bool inclusive)
+{
+    size_t i = 0;
+    while(i < n) {
+        if(i + SCAN_WINDOW <= n) {
+            uint64_t h[2];
+            memcpy(h, heads + i, sizeof(h));
+            if((h[0] | h[1]) == 0) {
+                carry = scanChunk(in + i, out + i, SCAN_WINDOW, carry, inclusive);
+                i += SCAN_WINDOW;
+                continue;
+            }
+        }
+        const size_t end = std::min(n, i + SCAN_WINDOW);
+        for(; i < end; i++) {
+            const T x = in[i];
+            const T before = heads[i] ? T() : carry;
+            out[i] = inclusive ? before + x : before;
+            carry = before + x;
+        }
+    }
+    return carry;
+}
+
+#ifdef __SSE2__
+// Four at a time: the shift-and-adds skip lanes at or after a head in the register, and the carry reaches only lanes before the first head
+static inline int32_t scanSegmentedChunk(const int32_t* in, const uint8_t* heads, int32_t* out, size_t n, int32_t carry,
+                                         bool inclusive)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c = _mm_set1_epi32(carry);
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        int32_t h4;
+        memcpy(&h4, heads + i, 4);
+        const __m128i bytes = _mm_cvtsi32_si128(h4);
+        // all ones in the lanes that start a vector, then in every lane from one on
+        __m128i f = _mm_cmpgt_epi32(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero), zero);
+        const __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i v = _mm_add_epi32(x, _mm_andnot_si128(f, _mm_slli_si128(x, 4)));
+        f = _mm_or_si128(f, _mm_slli_si128(f, 4));
+        v = _mm_add_epi32(v, _mm_andnot_si128(f, _mm_slli_si128(v, 8)));
+        f = _mm_or_si128(f, _mm_slli_si128(f, 8));
+        v = _mm_add_epi32(v, _mm_andnot_si128(f, c));
+        _mm_storeu_si128((__m128i*)(out + i), inclusive ? v : _mm_sub_epi32(v, x));
+        c = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    return scanSegmentedChunk<int32_t>(in + i, heads + i, out + i, n - i, _mm_cvtsi128_si32(c), inclusive);
+}
+#endif
+
+// The sum of in[0..n) since its last head, and whether there is a head
+template<typename T>
+T scanSegmentedTail(const T* in, const uint8_t* heads, size_t n, bool* hasHead)
+{
+    size_t last = n;
+    while(last > 0 && !heads[last-1]) {
+        last--;
+    }
+    // the head is at last-1, or there is none and the sum is the whole chunk's
+    *hasHead = last > 0;
+    const size_t start = last > 0 ? last - 1 : 0;
+    return scanSum(in + start, n - start);
+}
+
+/**----------------------------------------------------------------------------
+ * scanBlocked() with the sum restarting at heads. A block's carry is the sum
+ * of the blocks before it back to the last one that has a head, plus that
+ * block's sum after its last head.
+ */
+template<typename ParallelFor, typename T>
+void scanSegmented(const ParallelFor& pfor, const T* in, const uint8_t* heads, T* out, size_t n, bool inclusive,
+                   int blocks)
+{
+    if(blocks <= 1) {
+        scanSegmentedChunk(in, heads, out, n, T(), inclusive);
+        return;
+    }
+    std::vector<T> tails(blocks);
+    std::vector<char> hasHead(blocks);
+    pfor(0, blocks, [&](int b, int e) {
+        for(int k=b;k<e;k++) {
+            const size_t lo = scanBlockStart(n, blocks, k), hi = scanBlockStart(n, blocks, k+1);
+            bool h;
+            tails[k] = scanSegmentedTail(in + lo, heads + lo, hi - lo, &h);
+            hasHead[k] = h;
+        }
+    });
+    std::vector<T> carries(blocks);
+    T carry = T();
+    for(int k=0;k<blocks;k++) {
+        carries[k] = carry;
+        carry = hasHead[k] ? tails[k] : carry + tails[k];
+    }
+    pfor(0, blocks, [&](int b, int e) {
+        for(int k=b;k<e;k++) {
+            const size_t lo = scanBlockStart(n, blocks, k), hi = scanBlockStart(n, blocks, k+1);
+            scanSegmentedChunk(in + lo, heads + lo, out + lo, hi - lo, carries[k], inclusive);
+        }
+    });
+} //END scanSegmented()
+
+
+/**----------------------------------------------------------------------------
+ * Batches of vectors in CSR form: vector v is values[offsets[v] ..
+ * offsets[v+1]), for v in [0, count), with offsets non-decreasing. Every
+ * vector is scanned on its own, into the same places of out.
+ *
+ * scanGroup() gives each vector to a thread, which balances only when the
+ * vectors are about the same length, and pays a task per vector when there
+ * are millions of short ones. scanBatch() splits the elements into equal
+ * blocks instead, whatever vector they are in, and runs scanSegmented()'s
+ * two passes: a vector that crosses into a block passes it its sum. Within
+ * a block the heads of each SCAN_TILE elements are marked from the offsets
+ * and the tile is scanned with scanSegmentedChunk(), or with scanChunk()
+ * when no vector starts inside it, so the work is one pass over the
+ * elements plus a store per vector, for any mix of lengths.
+ */
+static const size_t SCAN_TILE = 4096;
+
+// The vector element e is in: the last v with offsets[v] <= e, skipping empty vectors
+static inline size_t scanVectorAt(const size_t* offsets, size_t count, size_t e)
+{
+    return (size_t)(std::upper_bound(offsets, offsets + count + 1, e) - offsets) - 1;
+}
+
+template<typename ParallelFor, typename T>
+void scanBatch(const ParallelFor& pfor, const size_t* offsets, size_t count, const T* values, T* out, bool inclusive,
+               int blocks)
+{
+    if(count == 0 || offsets[count] == offsets[0]) {
+        return;
+    }
+    const size_t first = offsets[0], n = offsets[count] - first;
+    if(blocks <= 1) {
+        blocks = 1;
+    }
+
+    // the sum in each block of the vector it ends in, and whether that vector starts in the block
+    std::vector<T> tails(blocks);
+    std::vector<char> hasHead(blocks);
+    // one block has no carry to find
+    pfor(0, blocks == 1 ? 0 : blocks, [&](int b, int e) {
+        for(int k=b;k<e;k++) {
+            const size_t lo = first + scanBlockStart(n, blocks, k), hi = first + scanBlockStart(n, blocks, k+1);
+            if(lo == hi) {
+                tails[k] = T();
+                hasHead[k] = false;
+                continue;
+            }
+            const size_t start = offsets[scanVectorAt(offsets, count, hi - 1)];
+            hasHead[k] = start >= lo;
+            tails[k] = scanSum(values + std::max(start, lo), hi - std::max(start, lo));
+        }
+    });
+    std::vector<T> carries(blocks);
+    T carry = T();
+    for(int k=0;k<blocks-1;k++) {
+        carries[k] = carry;
+        carry = hasHead[k] ? tails[k] : carry + tails[k];
+    }
+    carries[blocks-1] = carry;
+
+    pfor(0, blocks, [&](int b, int e) {
+        uint8_t heads[SCAN_TILE];
+        for(int k=b;k<e;k++) {
+            const size_t lo = first + scanBlockStart(n, blocks, k), hi = first + scanBlockStart(n, blocks, k+1);
+            if(lo == hi) {
+                continue;
+            }
+            // the first vector that starts in the block, if any
+            size_t v = std::lower_bound(offsets, offsets + count, lo) - offsets;
+            T c = carries[k];
+            for(size_t tile=lo;tile<hi;tile+=SCAN_TILE) {
+                const size_t end = std::min(hi, tile + SCAN_TILE);
+                size_t w = v;
+                while(w < count && offsets[w] == tile) {
+                    w++;
+                }
+                if(w == count || offsets[w] >= end) {
+                    // no head after the tile's first element: one plain scan
+                    c = scanChunk(values + tile, out + tile, end - tile, w > v ? T() : c, inclusive);
+                    v = w;
+                    continue;
+                }
+                memset(heads, 0, end - tile);
+                for(; v < count && offsets[v] < end; v++) {
+                    heads[offsets[v] - tile] = 1;
+                }
+                c = scanSegmentedChunk(values + tile, heads, out + tile, end - tile, c, inclusive);
+            }
+        }
+    });
+} //END scanBatch()
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Accuracy vs speed of the gaussian blur engines in stencil_kernels.cpp on
+ * a synthetic image, serially:
+ *     direct     the O(r^2) loop apply_stencil() uses
+ *     separable  the exact gaussian as a column pass then a row pass, O(r)
+ *     3-box      three running-sum box filters (-a), O(1) in the radius
+ * Errors are against the exact gaussian, in 8 bit levels, with the PSNR of
+ * the 8 bit images the programs would write. Taps outside the image are
+ * skipped without renormalizing, so near the border both filters darken
+ * by different amounts; those pixels are reported on their own.
+ *
+ *     ./stencil_bench [size] [maxDirectRadius]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <omp.h>
+
+#include "stencil_kernels.cpp"
+
+struct serial_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        f(begin, end);
+    }
+};
+
+// Noise over a few edges and gradients so both flat and busy areas are measured
+static void synthetic_image(const int rows, const int cols, std::vector<double>& img) {
+    img.resize((size_t)rows * cols * 3);
+    unsigned int seed = 12345;
+    for(int j = 0; j < cols; ++j) {
+        for(int i = 0; i < rows; ++i) {
+            double * const p = &img[((size_t)i + (size_t)j*rows) * 3];
+            for(int c = 0; c < 3; ++c) {
+                seed = seed * 1103515245u + 12345u;
+                const double noise = ((seed >> 16) & 0xff) / 255.0;
+                const double shape = ((i / 64 + j / 64) % 2) * 0.5 + 0.5 * (double)(i + c * j) / (rows + 2 * cols);
+                p[c] = 0.7 * shape + 0.3 * noise;
+            }
+        }
+    }
+}
+
+// Max and RMS difference in 8 bit levels over pixels at least margin from the
+// border (or all of them for margin 0), and the PSNR of the quantized images
+static void compare(const int rows, const int cols, const int margin, const std::vector<double>& ref,
+                    const std::vector<double>& img, double& maxErr, double& rmsErr, double& psnr) {
+    double sq = 0.0, sq8 = 0.0;
+    size_t n = 0;
+    maxErr = 0.0;
+    for(int j = margin; j < cols - margin; ++j) {
+        for(int i = margin; i < rows - margin; ++i) {
+            for(size_t e = ((size_t)i + (size_t)j*rows) * 3, c = 0; c < 3; ++e, ++c) {
+                const double d = (img[e] - ref[e]) * 255.0;
+                const double d8 = floor(img[e] * 255.0) - floor(ref[e] * 255.0);
+                maxErr = fabs(d) > maxErr ? fabs(d) : maxErr;
+                sq += d * d;
+                sq8 += d8 * d8;
+                ++n;
+            }
+        }
+    }
+    rmsErr = sqrt(sq / n);
+    psnr = sq8 == 0.0 ? INFINITY : 10.0 * log10(255.0 * 255.0 / (sq8 / n));
+}
+
+int main(int argc, char* argv[]) {
+    const int size = argc > 1 ? atoi(argv[1]) : 1024;
+    const int maxDirect = argc > 2 ? atoi(argv[2]) : 20;
+    if(size < 16) {
+        fprintf(stderr, "Usage: %s [size] [maxDirectRadius]\n", argv[0]);
+        return 1;
+    }
+    const int rows = size, cols = size;
+    std::vector<double> in, exact, out, work;
+    synthetic_image(rows, cols, in);
+    exact.resize(in.size());
+    out.resize(in.size());
+
+    // radius, stddev: the programs' built-in blur, then 3 sigma wide kernels
+    const int radii[] = { 3, 3, 5, 10, 20, 40, 80 };
+    const double stddevs[] = { 32.0, 1.0, 5.0 / 3, 10.0 / 3, 20.0 / 3, 40.0 / 3, 80.0 / 3 };
+
+    printf("%dx%d image, 3 channels, 1 thread; times in seconds, errors in 8 bit levels vs the exact gaussian\n", rows, cols);
+    printf("                |            time                  speedup     |              interior            |   whole image\n");
+    printf("radius  stddev  |  direct  separable   3-box | vs direct  vs sep | boxes      max err rms err  PSNR | max err  PSNR\n");
+    for(size_t t = 0; t < sizeof(radii) / sizeof(radii[0]); ++t) {
+        const int r = radii[t];
+        const double s = stddevs[t];
+        stencil_kernel g;
+        kernel_gaussian(r, s, g);
+        // force the exact two pass engine whatever kernel_finalize() picked
+        g.engine = ENGINE_SEPARABLE;
+
+        double direct = -1.0;
+        if(r <= maxDirect) {
+            stencil_kernel d = g;
+            d.engine = ENGINE_DIRECT;
+            const double start = omp_get_wtime();
+            apply_kernel(serial_for(), d, rows, cols, 3, in.data(), out.data(), work);
+            direct = omp_get_wtime() - start;
+        }
+
+        double start = omp_get_wtime();
+        apply_kernel(serial_for(), g, rows, cols, 3, in.data(), exact.data(), work);
+        const double separable = omp_get_wtime() - start;
+
+        start = omp_get_wtime();
+        apply_box_gaussian(serial_for(), r, s, rows, cols, 3, in.data(), out.data(), work);
+        const double box = omp_get_wtime() - start;
+
+        int boxes[3];
+        box_gaussian_radii(truncated_gaussian_stddev(r, s), boxes);
+        double maxErr, rmsErr, psnr, allMax, allRms, allPsnr;
+        compare(rows, cols, r + boxes[0] + boxes[1] + boxes[2], exact, out, maxErr, rmsErr, psnr);
+        compare(rows, cols, 0, exact, out, allMax, allRms, allPsnr);
+
+        char directText[16], speedupText[16];
+        if(direct < 0.0) {
+            snprintf(directText, sizeof(directText), "%8s", "-");
+            snprintf(speedupText, sizeof(speedupText), "%8s", "-");
+        } else {
+            snprintf(directText, sizeof(directText), "%8.3f", direct);
+            snprintf(speedupText, sizeof(speedupText), "%7.1fx", direct / box);
+        }
+        printf("%6d %7.2f  | %s %9.3f %8.3f | %s %6.1fx | %3d %3d %3d %8.2f %7.3f %5.1f | %7.2f %5.1f\n",
+               r, s, directText, separable, box, speedupText, separable / box,
+               boxes[0], boxes[1], boxes[2], maxErr, rmsErr, psnr, allMax, allPsnr);
+    }
+    return 0;
+}
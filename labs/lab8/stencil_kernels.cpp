@@ -0,0 +1,607 @@
+#ifndef STENCIL_KERNELS
+#define STENCIL_KERNELS
+/*
+ * A small stencil kernel library shared by the stencil programs.
+ *
+ * Kernels use the same layout as gaussian_kernel(): an odd rows x cols
+ * array stored column major, kernel[kx + ky*rows] weighting the pixel kx-rows/2
+ * image rows and ky-cols/2 image columns away. Images are the same column
+ * major arrays the programs already use (offset = i + j*rows) with nch
+ * interleaved double channels, so a pixel array is passed as (double*)pixels, 3.
+ *
+ * Taps that fall outside the image are skipped, exactly like apply_stencil().
+ *
+ * Each kernel picks the cheapest engine that reproduces it:
+ *     ENGINE_BOX       all weights equal: running window sums, O(1) per pixel
+ *     ENGINE_SEPARABLE rank one: a column pass then a row pass, O(rows+cols)
+ *     ENGINE_DIRECT    anything else, O(rows*cols)
+ *
+ * The engines do their work over a range of image columns [jb, je); the
+ * programs supply the parallel loop as a functor
+ *     pfor(begin, end, f)  calls f(b, e) on disjoint sub-ranges covering [begin, end)
+ * so the same code runs under Cilk, OpenMP, TBB or serially.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+
+enum kernel_engine { ENGINE_DIRECT, ENGINE_SEPARABLE, ENGINE_BOX };
+
+struct stencil_kernel {
+    int rows;
+    int cols;
+    std::vector<double> weights;  // weights[kx + ky*rows]
+    std::vector<double> colFactor; // separable engines: weights[kx + ky*rows] == colFactor[kx]*rowFactor[ky]
+    std::vector<double> rowFactor;
+    kernel_engine engine;
+    double gaussianStddev; // > 0 for kernels built by kernel_gaussian()
+
+    stencil_kernel() : rows(0), cols(0), engine(ENGINE_DIRECT), gaussianStddev(0.0) {};
+
+    // true once the kernel has been built
+    bool valid() const { return rows > 0; }
+};
+
+static const char* engine_name(kernel_engine e) {
+    switch(e) {
+        case ENGINE_BOX: return "box";
+        case ENGINE_SEPARABLE: return "separable";
+        default: return "direct";
+    }
+}
+
+/*
+ * Picks the engine for k. The kernel is rank one when every weight equals
+ * (its column through the largest weight) x (its row through the largest
+ * weight) / largest weight; that also yields the two factors.
+ */
+void kernel_finalize(stencil_kernel& k) {
+    const int n = k.rows * k.cols;
+    int pivot = 0;
+    double scale = 0.0;
+    for(int i = 0; i < n; ++i) {
+        if(fabs(k.weights[i]) > scale) {
+            scale = fabs(k.weights[i]);
+            pivot = i;
+        }
+    }
+    const double tol = 1e-12 * (scale > 0.0 ? scale : 1.0);
+    k.engine = ENGINE_DIRECT;
+    k.colFactor.assign(k.rows, 0.0);
+    k.rowFactor.assign(k.cols, 0.0);
+    if(scale == 0.0) {
+        // all zero: separable with zero factors
+        k.engine = ENGINE_SEPARABLE;
+        return;
+    }
+
+    const int pkx = pivot % k.rows;
+    const int pky = pivot / k.rows;
+    const double pv = k.weights[pivot];
+    for(int kx = 0; kx < k.rows; ++kx) {
+        k.colFactor[kx] = k.weights[kx + pky*k.rows];
+    }
+    for(int ky = 0; ky < k.cols; ++ky) {
+        k.rowFactor[ky] = k.weights[pkx + ky*k.rows] / pv;
+    }
+    bool rankOne = true, constant = true;
+    for(int ky = 0; ky < k.cols; ++ky) {
+        for(int kx = 0; kx < k.rows; ++kx) {
+            const double w = k.weights[kx + ky*k.rows];
+            rankOne = rankOne && fabs(w - k.colFactor[kx]*k.rowFactor[ky]) <= tol;
+            constant = constant && fabs(w - pv) <= tol;
+        }
+    }
+    if(constant) {
+        k.engine = ENGINE_BOX;
+    } else if(rankOne && n > 2*(k.rows + k.cols)) {
+        // two passes only pay off once the kernel is bigger than 3x3
+        k.engine = ENGINE_SEPARABLE;
+    }
+}
+
+// Builds a rows x cols kernel from values listed row by row, as it would be written on paper
+bool kernel_from_array(const int rows, const int cols, const double * const values, stencil_kernel& k) {
+    if(rows < 1 || cols < 1 || rows % 2 == 0 || cols % 2 == 0) {
+        fprintf(stderr, "Kernel dimensions must be odd, got %dx%d\n", rows, cols);
+        return false;
+    }
+    k.rows = rows;
+    k.cols = cols;
+    k.weights.resize(rows * cols);
+    for(int kx = 0; kx < rows; ++kx) {
+        for(int ky = 0; ky < cols; ++ky) {
+            k.weights[kx + ky*rows] = values[ky + kx*cols];
+        }
+    }
+    kernel_finalize(k);
+    return true;
+}
+
+// Builds the outer product of a column factor (along image rows) and a row factor (along image columns)
+bool kernel_from_factors(const int rows, const double * const colFactor, const int cols, const double * const rowFactor, stencil_kernel& k) {
+    std::vector<double> values(rows * cols);
+    for(int kx = 0; kx < rows; ++kx) {
+        for(int ky = 0; ky < cols; ++ky) {
+            values[ky + kx*cols] = colFactor[kx] * rowFactor[ky];
+        }
+    }
+    return kernel_from_array(rows, cols, values.data(), k);
+}
+
+// Normalized gaussian of the given radius, the same weights gaussian_kernel() produces
+void kernel_gaussian(const int radius, const double stddev, stencil_kernel& k) {
+    const int dim = 2*radius + 1;
+    std::vector<double> f(dim);
+    double sum = 0.0;
+    for(int x = 0; x < dim; ++x) {
+        const double d = x - radius;
+        f[x] = exp(-(d*d) / (2.0 * stddev * stddev));
+        sum += f[x];
+    }
+    for(int x = 0; x < dim; ++x) {
+        f[x] /= sum;
+    }
+    kernel_from_factors(dim, f.data(), dim, f.data(), k);
+    k.gaussianStddev = stddev;
+}
+
+// Normalized (2r+1)x(2r+1) mean filter
+void kernel_box(const int radius, stencil_kernel& k) {
+    const int dim = 2*radius + 1;
+    std::vector<double> f(dim, 1.0 / dim);
+    kernel_from_factors(dim, f.data(), dim, f.data(), k);
+}
+
+/*
+ * Gradient along image rows (the X kernel of prewittX_kernel()); the
+ * transpose is the matching Y gradient. Prewitt smooths with ones and
+ * differentiates with -1..0..+1, Sobel uses binomial smoothing and the
+ * binomial derivative, so radius 1 gives the usual 3x3 kernels.
+ */
+void kernel_prewitt(const int radius, stencil_kernel& k) {
+    const int dim = 2*radius + 1;
+    std::vector<double> deriv(dim), smooth(dim, 1.0);
+    for(int x = 0; x < dim; ++x) {
+        deriv[x] = (x > radius) - (x < radius);
+    }
+    kernel_from_factors(dim, deriv.data(), dim, smooth.data(), k);
+}
+
+void kernel_sobel(const int radius, stencil_kernel& k) {
+    const int dim = 2*radius + 1;
+    // binomial row of length dim-2, convolved with [-1 0 1] for the derivative
+    std::vector<double> binom(dim - 1, 0.0), smooth(dim, 0.0), deriv(dim, 0.0);
+    binom[0] = 1.0;
+    for(int n = 1; n < dim - 2; ++n) {
+        for(int x = n; x > 0; --x) {
+            binom[x] += binom[x-1];
+        }
+    }
+    for(int x = 0; x < dim - 2; ++x) {
+        deriv[x] -= binom[x];
+        deriv[x + 2] += binom[x];
+    }
+    smooth[0] = 1.0;
+    for(int n = 1; n < dim; ++n) {
+        for(int x = n; x > 0; --x) {
+            smooth[x] += smooth[x-1];
+        }
+    }
+    kernel_from_factors(dim, deriv.data(), dim, smooth.data(), k);
+}
+
+void kernel_laplacian(stencil_kernel& k) {
+    const double values[9] = { 0.0,  1.0, 0.0,
+                               1.0, -4.0, 1.0,
+                               0.0,  1.0, 0.0 };
+    kernel_from_array(3, 3, values, k);
+}
+
+void kernel_transpose(const stencil_kernel& in, stencil_kernel& out) {
+    std::vector<double> values(in.rows * in.cols);
+    // row by row listing of the transpose is the column major order of in
+    for(int i = 0; i < in.rows * in.cols; ++i) {
+        values[i] = in.weights[i];
+    }
+    kernel_from_array(in.cols, in.rows, values.data(), out);
+}
+
+// Parses "v,v,v" into values, returns false on anything that is not a number
+static bool parse_values(const char* text, std::vector<double>& values) {
+    values.clear();
+    while(*text) {
+        char* end;
+        values.push_back(strtod(text, &end));
+        if(end == text || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        text = *end ? end + 1 : end;
+    }
+    return !values.empty();
+}
+
+/*
+ * Builds a kernel from a command line spec:
+ *     gaussian:R[:S]     box:R     prewitt[:R]     sobel[:R]     laplacian
+ *     array:RxC:v,v,...  (R*C values, listed row by row)
+ *     sep:v,v,.../w,w,... (column factor / row factor)
+ */
+bool parse_kernel_spec(const char* spec, stencil_kernel& k) {
+    std::string s(spec);
+    const std::string name = s.substr(0, s.find(':'));
+    const std::string args = s.find(':') == std::string::npos ? "" : s.substr(s.find(':') + 1);
+    const int radius = args.empty() ? 1 : atoi(args.c_str());
+    bool ok = radius >= 1 && radius <= 1000;
+
+    if(ok && name == "gaussian") {
+        const size_t colon = args.find(':');
+        const double stddev = colon == std::string::npos ? radius / 2.0 : atof(args.c_str() + colon + 1);
+        ok = stddev > 0.0;
+        if(ok) kernel_gaussian(radius, stddev, k);
+    } else if(ok && name == "box") {
+        kernel_box(radius, k);
+    } else if(ok && name == "prewitt") {
+        kernel_prewitt(radius, k);
+    } else if(ok && name == "sobel") {
+        kernel_sobel(radius, k);
+    } else if(name == "laplacian") {
+        kernel_laplacian(k);
+        ok = true;
+    } else if(name == "array") {
+        int rows = 0, cols = 0, used = 0;
+        std::vector<double> values;
+        ok = sscanf(args.c_str(), "%dx%d:%n", &rows, &cols, &used) == 2 && used > 0
+             && parse_values(args.c_str() + used, values) && (int)values.size() == rows * cols
+             && kernel_from_array(rows, cols, values.data(), k);
+    } else if(name == "sep") {
+        const size_t slash = args.find('/');
+        std::vector<double> colFactor, rowFactor;
+        ok = slash != std::string::npos
+             && parse_values(args.substr(0, slash).c_str(), colFactor)
+             && parse_values(args.substr(slash + 1).c_str(), rowFactor)
+             && kernel_from_factors((int)colFactor.size(), colFactor.data(), (int)rowFactor.size(), rowFactor.data(), k);
+    } else {
+        ok = false;
+    }
+    if(!ok) {
+        fprintf(stderr, "Bad kernel spec '%s'\n", spec);
+    }
+    return ok;
+}
+
+/*
+ * Single range workers, each covering image columns [jb, je)
+ */
+
+// out = k applied directly
+void kernel_direct_cols(const stencil_kernel& k, const int rows, const int cols, const int nch,
+                        const double * const in, double * const out, const int jb, const int je) {
+    const int rk = k.rows / 2, ck = k.cols / 2;
+    for(int j = jb; j < je; ++j) {
+        for(int i = 0; i < rows; ++i) {
+            double acc[8] = { 0.0 };
+            for(int ky = 0; ky < k.cols; ++ky) {
+                const int y = j + ky - ck;
+                if(y < 0 || y >= cols) continue;
+                for(int kx = 0; kx < k.rows; ++kx) {
+                    const int x = i + kx - rk;
+                    if(x < 0 || x >= rows) continue;
+                    const double w = k.weights[kx + ky*k.rows];
+                    const double * const p = in + (size_t)(x + y*rows) * nch;
+                    for(int c = 0; c < nch; ++c) {
+                        acc[c] += w * p[c];
+                    }
+                }
+            }
+            double * const o = out + (size_t)(i + j*rows) * nch;
+            for(int c = 0; c < nch; ++c) {
+                o[c] = acc[c];
+            }
+        }
+    }
+}
+
+// tmp = colFactor applied along each column (the contiguous direction)
+void kernel_colpass_cols(const stencil_kernel& k, const int rows, const int nch,
+                         const double * const in, double * const tmp, const int jb, const int je) {
+    const int rk = k.rows / 2;
+    for(int j = jb; j < je; ++j) {
+        const double * const col = in + (size_t)j * rows * nch;
+        double * const t = tmp + (size_t)j * rows * nch;
+        if(k.engine == ENGINE_BOX) {
+            // running sum over the window [i-rk, i+rk] clipped to the column
+            const double w = k.colFactor[0];
+            double acc[8] = { 0.0 };
+            for(int x = 0; x < rk && x < rows; ++x) {
+                for(int c = 0; c < nch; ++c) acc[c] += col[x*nch + c];
+            }
+            for(int i = 0; i < rows; ++i) {
+                if(i + rk < rows) {
+                    for(int c = 0; c < nch; ++c) acc[c] += col[(i + rk)*nch + c];
+                }
+                if(i - rk - 1 >= 0) {
+                    for(int c = 0; c < nch; ++c) acc[c] -= col[(i - rk - 1)*nch + c];
+                }
+                for(int c = 0; c < nch; ++c) t[i*nch + c] = w * acc[c];
+            }
+            continue;
+        }
+        for(int i = 0; i < rows; ++i) {
+            double acc[8] = { 0.0 };
+            const int lo = i - rk < 0 ? rk - i : 0;
+            const int hi = i + rk >= rows ? rk + rows - i : k.rows;
+            for(int kx = lo; kx < hi; ++kx) {
+                const double w = k.colFactor[kx];
+                const double * const p = col + (i + kx - rk) * nch;
+                for(int c = 0; c < nch; ++c) acc[c] += w * p[c];
+            }
+            for(int c = 0; c < nch; ++c) t[i*nch + c] = acc[c];
+        }
+    }
+}
+
+// out = rowFactor applied across columns of tmp; whole columns are updated at once
+void kernel_rowpass_cols(const stencil_kernel& k, const int rows, const int cols, const int nch,
+                         const double * const tmp, double * const out, const int jb, const int je) {
+    const int ck = k.cols / 2;
+    const size_t colLen = (size_t)rows * nch;
+    if(k.engine == ENGINE_BOX) {
+        // running sum of whole columns over the window [j-ck, j+ck] clipped to the image
+        const double w = k.rowFactor[0];
+        std::vector<double> acc(colLen, 0.0);
+        for(int y = jb - ck; y < jb + ck; ++y) {
+            if(y < 0 || y >= cols) continue;
+            const double * const t = tmp + y * colLen;
+            for(size_t e = 0; e < colLen; ++e) acc[e] += t[e];
+        }
+        for(int j = jb; j < je; ++j) {
+            if(j + ck < cols) {
+                const double * const t = tmp + (j + ck) * colLen;
+                for(size_t e = 0; e < colLen; ++e) acc[e] += t[e];
+            }
+            // the column leaving the window was only summed if it was inside [jb-ck, ...)
+            if(j > jb && j - ck - 1 >= 0) {
+                const double * const t = tmp + (j - ck - 1) * colLen;
+                for(size_t e = 0; e < colLen; ++e) acc[e] -= t[e];
+            }
+            double * const o = out + j * colLen;
+            for(size_t e = 0; e < colLen; ++e) o[e] = w * acc[e];
+        }
+        return;
+    }
+    for(int j = jb; j < je; ++j) {
+        double * const o = out + j * colLen;
+        for(size_t e = 0; e < colLen; ++e) o[e] = 0.0;
+        for(int ky = 0; ky < k.cols; ++ky) {
+            const int y = j + ky - ck;
+            if(y < 0 || y >= cols) continue;
+            const double w = k.rowFactor[ky];
+            const double * const t = tmp + y * colLen;
+            for(size_t e = 0; e < colLen; ++e) o[e] += w * t[e];
+        }
+    }
+}
+
+/*
+ * out = k applied to in (rows x cols, nch <= 8 channels) with the kernel's
+ * engine. tmp is working storage for the two pass engines and is resized
+ * as needed, so callers processing many images can keep it around.
+ */
+template<typename ParallelFor>
+void apply_kernel(const ParallelFor& pfor, const stencil_kernel& k, const int rows, const int cols, const int nch,
+                  const double * const in, double * const out, double * const tmp) {
+    if(k.engine == ENGINE_DIRECT) {
+        pfor(0, cols, [&](int jb, int je) { kernel_direct_cols(k, rows, cols, nch, in, out, jb, je); });
+        return;
+    }
+    pfor(0, cols, [&](int jb, int je) { kernel_colpass_cols(k, rows, nch, in, tmp, jb, je); });
+    pfor(0, cols, [&](int jb, int je) { kernel_rowpass_cols(k, rows, cols, nch, tmp, out, jb, je); });
+}
+
+template<typename ParallelFor>
+void apply_kernel(const ParallelFor& pfor, const stencil_kernel& k, const int rows, const int cols, const int nch,
+                  const double * const in, double * const out, std::vector<double>& tmp) {
+    tmp.resize((size_t)rows * cols * nch);
+    apply_kernel(pfor, k, rows, cols, nch, in, out, tmp.data());
+}
+
+/*
+ * Standard deviation of the gaussian of the given radius and stddev once
+ * it is truncated to 2*radius+1 taps. The stencil programs blur with
+ * radius 3 and stddev 32, which is almost flat and much narrower than 32.
+ */
+double truncated_gaussian_stddev(const int radius, const double stddev) {
+    double sum = 0.0, var = 0.0;
+    for(int d = -radius; d <= radius; ++d) {
+        const double w = exp(-(double)(d*d) / (2.0 * stddev * stddev));
+        sum += w;
+        var += w * d * d;
+    }
+    return sqrt(var / sum);
+}
+
+/*
+ * Radii of three successive box filters whose combined variance is close to
+ * stddev^2 (each box of width w adds (w^2-1)/12). Widths are the two odd
+ * integers around the ideal sqrt(4*stddev^2 + 1), as many of the smaller
+ * as keeps the variance closest.
+ */
+void box_gaussian_radii(const double stddev, int radii[3]) {
+    const int n = 3;
+    const double var = stddev * stddev;
+    int wl = (int)floor(sqrt(12.0 * var / n + 1.0));
+    if(wl % 2 == 0) {
+        wl--;
+    }
+    if(wl < 1) {
+        wl = 1;
+    }
+    const int wu = wl + 2;
+    const int m = (int)lround((12.0 * var - n*wl*wl - 4.0*n*wl - 3.0*n) / (-4.0*wl - 4.0));
+    for(int b = 0; b < n; ++b) {
+        radii[b] = ((b < m ? wl : wu) - 1) / 2;
+    }
+}
+
+/*
+ * Approximates the truncated gaussian (radius, stddev) with three box
+ * filters, each done with running sums so the cost per pixel does not
+ * depend on the radius. work is resized to two images.
+ */
+template<typename ParallelFor>
+void apply_box_gaussian(const ParallelFor& pfor, const int radius, const double stddev, const int rows, const int cols,
+                        const int nch, const double * const in, double * const out, std::vector<double>& work) {
+    const size_t n = (size_t)rows * cols * nch;
+    work.resize(2 * n);
+    double * const tmp = work.data();
+    double * const mid = tmp + n;
+    int radii[3];
+    box_gaussian_radii(truncated_gaussian_stddev(radius, stddev), radii);
+    stencil_kernel box;
+    kernel_box(radii[0], box);
+    apply_kernel(pfor, box, rows, cols, nch, in, out, tmp);
+    kernel_box(radii[1], box);
+    apply_kernel(pfor, box, rows, cols, nch, out, mid, tmp);
+    kernel_box(radii[2], box);
+    apply_kernel(pfor, box, rows, cols, nch, mid, out, tmp);
+}
+
+/*
+ * Edge magnitude of the blurred pixels (3 channels) into out (3 channels,
+ * all set to the magnitude), computed on the gray intensity like
+ * apply_prewittKs(). With a Y kernel the magnitude is sqrt(X^2 + Y^2),
+ * without one it is |X| (e.g. for a Laplacian). work is resized to four
+ * planes: the intensity, both gradients and the two pass intermediate.
+ */
+template<typename ParallelFor>
+void apply_edge_kernels(const ParallelFor& pfor, const stencil_kernel& kx, const stencil_kernel* ky,
+                        const int rows, const int cols, const double * const blurred, double * const out,
+                        std::vector<double>& work) {
+    const size_t n = (size_t)rows * cols;
+    work.resize(4 * n);
+    double * const intensity = work.data();
+    double * const gx = intensity + n;
+    double * const gy = gx + n;
+    double * const tmp = gy + n;
+    pfor(0, cols, [&](int jb, int je) {
+        for(size_t e = (size_t)jb * rows; e < (size_t)je * rows; ++e) {
+            intensity[e] = (blurred[3*e] + blurred[3*e + 1] + blurred[3*e + 2]) / 3.0;
+        }
+    });
+    apply_kernel(pfor, kx, rows, cols, 1, intensity, gx, tmp);
+    if(ky) {
+        apply_kernel(pfor, *ky, rows, cols, 1, intensity, gy, tmp);
+    }
+    pfor(0, cols, [&](int jb, int je) {
+        for(size_t e = (size_t)jb * rows; e < (size_t)je * rows; ++e) {
+            const double m = ky ? sqrt(gx[e]*gx[e] + gy[e]*gy[e]) : fabs(gx[e]);
+            out[3*e] = out[3*e + 1] = out[3*e + 2] = m;
+        }
+    });
+}
+
+/*
+ * Blur and edge settings shared by the stencil programs' command lines:
+ *     -k spec   blur kernel
+ *     -e spec   edge kernel; a prewitt or sobel spec is used as the X
+ *               gradient with its transpose as Y, any other kernel is
+ *               applied alone and its absolute response kept
+ *     -a        approximate the gaussian blur (built-in or -k gaussian)
+ *               with three running-sum box filters
+ */
+struct kernel_options {
+    stencil_kernel blur;
+    stencil_kernel edgeX;
+    stencil_kernel edgeY;
+    bool boxGaussian;
+
+    kernel_options() : boxGaussian(false) {};
+
+    // true when the blur or edge stage no longer uses the built-in kernels
+    bool custom() const { return blur.valid() || edgeX.valid() || boxGaussian; }
+};
+
+// Handles one of the -k, -e or -a getopt options, false on a bad spec
+bool parse_kernel_option(const int opt, const char* spec, kernel_options& o) {
+    if(opt == 'a') {
+        o.boxGaussian = true;
+        return true;
+    }
+    if(opt == 'k') {
+        return parse_kernel_spec(spec, o.blur);
+    }
+    if(!parse_kernel_spec(spec, o.edgeX)) {
+        return false;
+    }
+    const std::string name(spec);
+    o.edgeY = stencil_kernel();
+    if(name.compare(0, 7, "prewitt") == 0 || name.compare(0, 5, "sobel") == 0) {
+        kernel_transpose(o.edgeX, o.edgeY);
+    }
+    return true;
+}
+
+// Checks the options once all are parsed and reports the engines in use;
+// radius and stddev are the program's built-in gaussian
+bool check_kernel_options(const kernel_options& o, const int radius, const double stddev) {
+    if(o.boxGaussian && o.blur.valid() && o.blur.gaussianStddev <= 0.0) {
+        fprintf(stderr, "-a only approximates gaussian blurs\n");
+        return false;
+    }
+    if(o.boxGaussian) {
+        int radii[3];
+        box_gaussian_radii(truncated_gaussian_stddev(o.blur.valid() ? o.blur.rows / 2 : radius,
+                                                     o.blur.valid() ? o.blur.gaussianStddev : stddev), radii);
+        printf("blur approximated by boxes of radius %d, %d, %d\n", radii[0], radii[1], radii[2]);
+    } else if(o.blur.valid()) {
+        printf("blur kernel %dx%d, %s engine\n", o.blur.rows, o.blur.cols, engine_name(o.blur.engine));
+    }
+    if(o.edgeX.valid()) {
+        printf("edge kernel %dx%d, %s engine\n", o.edgeX.rows, o.edgeX.cols, engine_name(o.edgeX.engine));
+    }
+    return true;
+}
+
+/*
+ * Runs the blur selected by o on a 3 channel image. Returns false when
+ * nothing was selected and the program's own gaussian (radius, stddev)
+ * should run instead.
+ */
+template<typename ParallelFor>
+bool apply_blur_options(const ParallelFor& pfor, const kernel_options& o, const int radius, const double stddev,
+                        const int rows, const int cols, const double * const in, double * const out,
+                        std::vector<double>& work) {
+    if(o.boxGaussian) {
+        apply_box_gaussian(pfor, o.blur.valid() ? o.blur.rows / 2 : radius, o.blur.valid() ? o.blur.gaussianStddev : stddev,
+                           rows, cols, 3, in, out, work);
+        return true;
+    }
+    if(o.blur.valid()) {
+        apply_kernel(pfor, o.blur, rows, cols, 3, in, out, work);
+        return true;
+    }
+    return false;
+}
+
+// Edge counterpart of apply_blur_options(), false when the built-in Prewitt pair should run
+template<typename ParallelFor>
+bool apply_edge_options(const ParallelFor& pfor, const kernel_options& o, const int rows, const int cols,
+                        const double * const blurred, double * const out, std::vector<double>& work) {
+    if(!o.edgeX.valid()) {
+        return false;
+    }
+    apply_edge_kernels(pfor, o.edgeX, o.edgeY.valid() ? &o.edgeY : NULL, rows, cols, blurred, out, work);
+    return true;
+}
+
+static const char* const kernel_usage =
+    "  -k spec  blur kernel instead of the built-in 7x7 gaussian\n"
+    "  -e spec  edge kernel instead of the built-in 3x3 Prewitt pair\n"
+    "  -a       approximate the gaussian blur with three running-sum box filters\n"
+    "  spec: gaussian:R[:S] box:R prewitt[:R] sobel[:R] laplacian\n"
+    "        array:RxC:v,v,... (row by row) sep:v,v,.../w,w,... (column/row factors)\n";
+#endif
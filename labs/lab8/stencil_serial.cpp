@@ -2,6 +2,8 @@
 #include <cmath>
 #include <cstdint>
 #include <iostream>
+#include <vector>
+#include <unistd.h>
 #include <opencv2/opencv.hpp>
 #include <omp.h>
 
@@ -15,6 +17,20 @@ struct pixel {
 	pixel(double r, double g, double b) : red(r), green(g), blue(b) {};
 };
 
+#include "stencil_kernels.cpp"
+
+static_assert(sizeof(pixel) == 3 * sizeof(double), "the kernel library reads pixels as 3 doubles");
+
+// The kernel library's parallel loop hook, run in order here
+struct serial_for {
+	template<typename F> void operator()(const int begin, const int end, const F& f) const {
+		f(begin, end);
+	}
+};
+
+// Kernels chosen with -k/-e/-a; the built-in gaussian and Prewitt are used otherwise
+static kernel_options kernels;
+
 /*
  * The Prewitt kernels can be applied after a blur to help highlight edges
  * The input image must be gray scale/intensities:
@@ -157,16 +173,21 @@ void apply_stencil(const int radius, const double stddev, const int rows, const
 int main( int argc, char* argv[] ) {
     double start, end;
 
-	if(argc != 2) {
-		std::cerr << "Usage: " << argv[0] << " imageName\n";
+	bool badArgs = false;
+	int opt;
+	while((opt = getopt(argc, argv, "k:e:a")) != -1) {
+		badArgs = badArgs || opt == '?' || !parse_kernel_option(opt, optarg, kernels);
+	}
+	if(badArgs || argc - optind != 1 || !check_kernel_options(kernels, 3, 32.0)) {
+		std::cerr << "Usage: " << argv[0] << " [-k spec] [-e spec] [-a] imageName\n" << kernel_usage;
 		return 1;
 	}    
 
 	// Read image
 	Mat image;
-	image = imread(argv[1], CV_LOAD_IMAGE_COLOR);
+	image = imread(argv[optind], CV_LOAD_IMAGE_COLOR);
 	if(!image.data ) {
-		std::cout <<  "Error opening " << argv[1] << std::endl;
+		std::cout <<  "Error opening " << argv[optind] << std::endl;
 		return -1;
 	}
 	
@@ -198,10 +219,15 @@ int main( int argc, char* argv[] ) {
 	}	
 
 	// Do the stencil
-	apply_stencil(3, 32.0, rows, cols, imagePixels, blurred);
+	std::vector<double> kernelWork;
+	if(!apply_blur_options(serial_for(), kernels, 3, 32.0, rows, cols, (double *)imagePixels, (double *)blurred, kernelWork)) {
+		apply_stencil(3, 32.0, rows, cols, imagePixels, blurred);
+	}
     
     // Apply grayscale processing
-    apply_prewittKs(rows, cols, blurred, outPixels);
+	if(!apply_edge_options(serial_for(), kernels, rows, cols, (double *)blurred, (double *)outPixels, kernelWork)) {
+		apply_prewittKs(rows, cols, blurred, outPixels);
+	}
 
 	// Create an output image (same size as input)
 	Mat dest(rows, cols, CV_8UC3);
@@ -209,9 +235,9 @@ int main( int argc, char* argv[] ) {
 	for(int i = 0; i < rows; ++i) {
 		for(int j = 0; j < cols; ++j) {
 			const size_t offset = i + (j*rows);
-			dest.at<Vec3b>(i, j) = Vec3b(floor(outPixels[offset].red * 255.0),
-										 floor(outPixels[offset].green * 255.0),
-										 floor(outPixels[offset].blue * 255.0));
+			dest.at<Vec3b>(i, j) = Vec3b(saturate_cast<uchar>(floor(outPixels[offset].red * 255.0)),
+										 saturate_cast<uchar>(floor(outPixels[offset].green * 255.0)),
+										 saturate_cast<uchar>(floor(outPixels[offset].blue * 255.0)));
 		}
 	}
 	
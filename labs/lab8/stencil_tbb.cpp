@@ -3,13 +3,35 @@
 #include <cstdint>
 #include <iostream>
 #include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <tbb/tbb.h>
-#include "tbb/parallel_reduce.h"
-#include "tbb/blocked_range.h"
+#include "tbb/blocked_range2d.h"
+#include "tbb/partitioner.h"
+#include "tbb/pipeline.h"
+#include "tbb/concurrent_queue.h"
 #include <omp.h>
 
 using namespace cv;
 
+// Edge length of the (column x row) tiles every stage is split into.
+// Can be overridden with the optional grain argument.
+static int grain = 32;
+
+// Selects the 8/16-bit integer path (-p fixed) instead of doubles
+static bool fixedPoint = false;
+
+// Blur radius and spread used by both precision paths
+static const int blurRadius = 3;
+static const double blurStddev = 32.0;
+
 struct pixel {
 	double red;
 	double green;
@@ -18,6 +40,75 @@ struct pixel {
 	pixel(double r, double g, double b) : red(r), green(g), blue(b) {};
 };
 
+#include "stencil_kernels.cpp"
+
+static_assert(sizeof(pixel) == 3 * sizeof(double), "the kernel library reads pixels as 3 doubles");
+
+// The kernel library's parallel loop hook. Blocks stay a few grains wide so
+// the running-sum box engine rarely restarts its window.
+struct tbb_for {
+	template<typename F> void operator()(const int begin, const int end, const F& f) const {
+		tbb::parallel_for (
+			tbb::blocked_range<int> ( begin, end, 4 * grain ),
+			[&](const tbb::blocked_range<int>& r) { f(r.begin(), r.end()); });
+	}
+};
+
+// Kernels chosen with -k/-e/-a; the built-in gaussian and Prewitt are used otherwise
+static kernel_options kernels;
+
+/*
+ * Working storage for one image. The arrays only grow, so in batch mode a
+ * scratch is reused across images instead of allocating per image.
+ *
+ * The loops keep affinity_partitioners here, so from one image to the next
+ * TBB replays the tile->thread mapping and keeps the tiles cache-warm. The
+ * 2-D loops of a path all cover the same tiles, so they share one
+ * partitioner: a thread gets the tile of the previous stage's output it
+ * wrote itself. Replay only helps when a partitioner sees the same
+ * iteration space every time, so the row loops have their own. A
+ * partitioner must not be shared by concurrent loops, which is why they
+ * live here and not in globals.
+ */
+struct scratch {
+	pixel * imagePixels;
+	pixel * blurred;
+	pixel * outPixels;
+	size_t capacity;
+	// fixed-point path: zero padded 8-bit input, 16-bit blur, padded intensities
+	std::vector<uint8_t> padded;
+	std::vector<uint16_t> blurred16;
+	std::vector<uint16_t> intensity;
+	// per thread blur accumulators, so a tile does not allocate its own
+	tbb::enumerable_thread_specific<std::vector<uint32_t> > blurAcc;
+	// -k/-e kernels: two-pass intermediate and edge planes
+	std::vector<double> kernelWork;
+	// double path: pixels in, gaussian, Prewitt and pixels out tiles
+	tbb::affinity_partitioner tileAp;
+	// fixed-point path: blur and Prewitt tiles, padding and intensity rows
+	tbb::affinity_partitioner tile16Ap, padAp, intensityAp;
+
+	scratch() : imagePixels(NULL), blurred(NULL), outPixels(NULL), capacity(0) {};
+	~scratch() {
+		free(imagePixels);
+		free(blurred);
+		free(outPixels);
+	}
+
+	void reserve(size_t n) {
+		if(n <= capacity) {
+			return;
+		}
+		free(imagePixels);
+		free(blurred);
+		free(outPixels);
+		imagePixels = (pixel *) malloc(n * sizeof(pixel));
+		blurred = (pixel *) malloc(n * sizeof(pixel));
+		outPixels = (pixel *) malloc(n * sizeof(pixel));
+		capacity = n;
+	}
+};
+
 /*
  * The Prewitt kernels can be applied after a blur to help highlight edges
  * The input image must be gray scale/intensities:
@@ -58,234 +149,544 @@ void prewittY_kernel(const int rows, const int cols, double * const kernel) {
         }
 }
 
-void apply_prewittKs (const int rows, const int cols, pixel * const blurred, pixel * const out)  {
+void apply_prewittKs (const int rows, const int cols, pixel * const blurred, pixel * const out, tbb::affinity_partitioner& ap)  {
 	double Xkernel[3*3], Ykernel[3*3];
-    
-    // initialize edge arrays    
-	double *Xedges = (double *) malloc(rows * cols * sizeof(double));
-	double *Yedges = (double *) malloc(rows * cols * sizeof(double));
-    tbb::parallel_for (
-        tbb::blocked_range<int> ( 0, rows * cols ),
-        [=](tbb::blocked_range<int> r) { 
-            for( int i = r.begin(); i < r.end(); ++i ) {
-		        Xedges[i] = 0.0;
-		        Yedges[i] = 0.0;
-            }
-        });
 
     // initialize prewitt kernels
     prewittX_kernel( 3, 3, Xkernel );
     prewittY_kernel( 3, 3, Ykernel );
 
     // compute prewitt kernel gradients for each pixel in the blurred array and populate output array in grayscale
+    // the gradients are accumulated in registers, so no zeroed edge arrays are needed
     tbb::parallel_for (
-        tbb::blocked_range<int> ( 0, cols ),
-        [=](tbb::blocked_range<int> r) { 
-            for( int j = r.begin(); j < r.end(); ++j ) {
-                tbb::parallel_for (
-                    tbb::blocked_range<int> ( 0, rows ),
-                    [=](tbb::blocked_range<int> r2) { 
-                        for( int i = r2.begin(); i < r2.end(); ++i ) {
-                            const int out_offset = i + (j*rows);
-                            // For each pixel in the stencil space, compute the X/Y gradient using the prewitt kernels
-                            for(int x = i - 1, kx = 0; x <= i + 1; ++x, ++kx) {
-                                for(int y = j - 1, ky = 0; y <= j + 1; ++y, ++ky) {
-                                    if(x >= 0 && x < rows && y >= 0 && y < cols) {
-                                        const int blurred_offset = x + (y*rows);
-                                        const int k_offset = kx + (ky*3);
-                                        double intensity = (blurred[blurred_offset].red + blurred[blurred_offset].green + blurred[blurred_offset].blue)/3.0;
-                                        Xedges[out_offset] += Xkernel[k_offset] * intensity;
-                                        Yedges[out_offset] += Ykernel[k_offset] * intensity;
-                                    }
-                                }
+        tbb::blocked_range2d<int> ( 0, cols, grain, 0, rows, grain ),
+        [=, &Xkernel, &Ykernel](const tbb::blocked_range2d<int>& r) { 
+            for( int j = r.rows().begin(); j < r.rows().end(); ++j ) {
+                for( int i = r.cols().begin(); i < r.cols().end(); ++i ) {
+                    const int out_offset = i + (j*rows);
+                    double Xedge = 0.0, Yedge = 0.0;
+                    // For each pixel in the stencil space, compute the X/Y gradient using the prewitt kernels
+                    for(int x = i - 1, kx = 0; x <= i + 1; ++x, ++kx) {
+                        for(int y = j - 1, ky = 0; y <= j + 1; ++y, ++ky) {
+                            if(x >= 0 && x < rows && y >= 0 && y < cols) {
+                                const int blurred_offset = x + (y*rows);
+                                const int k_offset = kx + (ky*3);
+                                double intensity = (blurred[blurred_offset].red + blurred[blurred_offset].green + blurred[blurred_offset].blue)/3.0;
+                                Xedge += Xkernel[k_offset] * intensity;
+                                Yedge += Ykernel[k_offset] * intensity;
                             }
-                            // compute euclidean distance between computed prewitt gradients to get a grayscale pixel intensity
-                            double outIntensity = sqrt( Xedges[out_offset]*Xedges[out_offset] + Yedges[out_offset]*Yedges[out_offset] );
-                            out[out_offset].red = outIntensity;
-                            out[out_offset].green = outIntensity;
-                            out[out_offset].blue = outIntensity;
-		                }
-	                });
+                        }
+                    }
+                    // compute euclidean distance between computed prewitt gradients to get a grayscale pixel intensity
+                    double outIntensity = sqrt( Xedge*Xedge + Yedge*Yedge );
+                    out[out_offset].red = outIntensity;
+                    out[out_offset].green = outIntensity;
+                    out[out_offset].blue = outIntensity;
+                }
             }
-        });
-
-    // free gradient storage
-    free( Xedges );
-    free( Yedges );
+        }, ap);
 }
 
 /*
  * The gaussian kernel provides a stencil for blurring images based on a 
  * normal distribution
+ *
+ * The kernel is at most a few hundred entries, far too small to amortize
+ * spawning tasks, so it is built and normalized serially.
  */
 void gaussian_kernel(const int rows, const int cols, const double stddev, double * const kernel) {
 	const double denom = 2.0 * stddev * stddev;
 	const double g_denom = M_PI * denom;
 	const double g_denom_recip = (1.0/g_denom);
-	
-    double sum = tbb::parallel_reduce(
-        tbb::blocked_range<int>( 0, cols ),
-        double( 0.0 ),
-        [=]( const tbb::blocked_range<int>& r, double in )->double {
-            for( int j=r.begin(); j!=r.end(); ++j ) {
-                tbb::parallel_for (
-                    tbb::blocked_range<int> ( 0, rows ),
-                    [=, &in]( tbb::blocked_range<int> r2 ) { 
-                        for( int i = r2.begin(); i < r2.end(); ++i ) {
-                            const double row_dist = i - (rows/2);
-                            const double col_dist = j - (cols/2);
-                            const double dist_sq = (row_dist * row_dist) + (col_dist * col_dist);
-                            const double value = g_denom_recip * exp((-dist_sq)/denom);
-                            kernel[i + (j*rows)] = value;
-                            in += value;
-                        }
-                    });
-            }
-            return in;
-        },
-        std::plus<double>()
-    );
-	
-    // Normalize
+	double sum = 0.0;
+
+	for(int j = 0; j < cols; ++j) {
+		for(int i = 0; i < rows; ++i) {
+			const double row_dist = i - (rows/2);
+			const double col_dist = j - (cols/2);
+			const double dist_sq = (row_dist * row_dist) + (col_dist * col_dist);
+			const double value = g_denom_recip * exp((-dist_sq)/denom);
+			kernel[i + (j*rows)] = value;
+			sum += value;
+		}
+	}
+	// Normalize
 	const double recip_sum = 1.0 / sum;
-    tbb::parallel_for (
-        tbb::blocked_range<int> ( 0, cols ),
-        [=](tbb::blocked_range<int> r) { 
-            for( int j = r.begin(); j < r.end(); ++j ) {
-                tbb::parallel_for (
-                    tbb::blocked_range<int> ( 0, rows ),
-                    [=](tbb::blocked_range<int> r2) { 
-                        for( int i = r2.begin(); i < r2.end(); ++i ) {
-			                kernel[i + (j*rows)] *= recip_sum;
-                        }
-                    });
-            }
-        });
+	for(int k = 0; k < rows * cols; ++k) {
+		kernel[k] *= recip_sum;
+	}
 }
 
-void apply_stencil(const int radius, const double stddev, const int rows, const int cols, pixel * const in, pixel * const out) {
+void apply_stencil(const int radius, const double stddev, const int rows, const int cols, pixel * const in, pixel * const out, tbb::affinity_partitioner& ap) {
 	const int dim = radius*2+1;
 	double kernel[dim*dim];
 	gaussian_kernel(dim, dim, stddev, kernel);
 	
     tbb::parallel_for (
-        tbb::blocked_range<int> ( 0, cols ),
-        [=, &kernel](tbb::blocked_range<int> r) { 
-            for( int j = r.begin(); j < r.end(); ++j ) {
-                tbb::parallel_for (
-                    tbb::blocked_range<int> ( 0, rows ),
-                    [=, &kernel](tbb::blocked_range<int> r2) { 
-                        for( int i = r2.begin(); i < r2.end(); ++i ) {
-                            const int out_offset = i + (j*rows);
-                            // For each pixel, do the stencil
-                            for(int x = i - radius, kx = 0; x <= i + radius; ++x, ++kx) {
-                                for(int y = j - radius, ky = 0; y <= j + radius; ++y, ++ky) {
-                                    if(x >= 0 && x < rows && y >= 0 && y < cols) {
-                                        const int in_offset = x + (y*rows);
-                                        const int k_offset = kx + (ky*dim);
-                                        out[out_offset].red   += kernel[k_offset] * in[in_offset].red;
-                                        out[out_offset].green += kernel[k_offset] * in[in_offset].green;
-                                        out[out_offset].blue  += kernel[k_offset] * in[in_offset].blue;
-                                    }
-                                }
+        tbb::blocked_range2d<int> ( 0, cols, grain, 0, rows, grain ),
+        [=, &kernel](const tbb::blocked_range2d<int>& r) { 
+            for( int j = r.rows().begin(); j < r.rows().end(); ++j ) {
+                for( int i = r.cols().begin(); i < r.cols().end(); ++i ) {
+                    const int out_offset = i + (j*rows);
+                    double red = 0.0, green = 0.0, blue = 0.0;
+                    // For each pixel, do the stencil
+                    for(int x = i - radius, kx = 0; x <= i + radius; ++x, ++kx) {
+                        for(int y = j - radius, ky = 0; y <= j + radius; ++y, ++ky) {
+                            if(x >= 0 && x < rows && y >= 0 && y < cols) {
+                                const int in_offset = x + (y*rows);
+                                const int k_offset = kx + (ky*dim);
+                                red   += kernel[k_offset] * in[in_offset].red;
+                                green += kernel[k_offset] * in[in_offset].green;
+                                blue  += kernel[k_offset] * in[in_offset].blue;
                             }
                         }
-                    });
+                    }
+                    out[out_offset].red   = red;
+                    out[out_offset].green = green;
+                    out[out_offset].blue  = blue;
+                }
+            }
+        }, ap);
+}
+
+/*
+ * Blur and edge detect one image into dest (same size as image), using the
+ * arrays in s as working storage
+ */
+void process_image(const Mat& image, Mat& dest, scratch& s) {
+	// Get image into C array of doubles for processing
+	const int rows = image.rows;
+	const int cols = image.cols;
+	s.reserve((size_t)rows * cols);
+	pixel * const imagePixels = s.imagePixels;
+	pixel * const blurred = s.blurred;
+	pixel * const outPixels = s.outPixels;
+    tbb::parallel_for (
+        tbb::blocked_range2d<int> ( 0, cols, grain, 0, rows, grain ),
+        [=, &image](const tbb::blocked_range2d<int>& r) { 
+            for( int j = r.rows().begin(); j < r.rows().end(); ++j ) {
+                for( int i = r.cols().begin(); i < r.cols().end(); ++i ) {
+                    Vec3b p = image.at<Vec3b>(i, j);
+                    imagePixels[i + (j*rows)] = pixel(p[0]/255.0,p[1]/255.0,p[2]/255.0);
+                }
+            }
+        }, s.tileAp);
+
+	// Do the stencil, every element of blurred and outPixels is assigned
+	if(!apply_blur_options(tbb_for(), kernels, blurRadius, blurStddev, rows, cols, (double *)imagePixels, (double *)blurred, s.kernelWork)) {
+		apply_stencil(blurRadius, blurStddev, rows, cols, imagePixels, blurred, s.tileAp);
+	}
+    
+    // Apply grayscale processing
+	if(!apply_edge_options(tbb_for(), kernels, rows, cols, (double *)blurred, (double *)outPixels, s.kernelWork)) {
+		apply_prewittKs(rows, cols, blurred, outPixels, s.tileAp);
+	}
+	
+	// Copy C array back into image for output
+	dest.create(rows, cols, CV_8UC3);
+    tbb::parallel_for (
+        tbb::blocked_range2d<int> ( 0, cols, grain, 0, rows, grain ),
+        [=, &dest](const tbb::blocked_range2d<int>& r) { 
+            for( int j = r.rows().begin(); j < r.rows().end(); ++j ) {
+                for( int i = r.cols().begin(); i < r.cols().end(); ++i ) {
+                    const size_t offset = i + (j*rows);
+                    // saturate: strong edges exceed 1.0 and would wrap around in a plain uchar conversion
+                    dest.at<Vec3b>(i, j) = Vec3b(saturate_cast<uchar>(floor(outPixels[offset].red * 255.0)),
+                                                 saturate_cast<uchar>(floor(outPixels[offset].green * 255.0)),
+                                                 saturate_cast<uchar>(floor(outPixels[offset].blue * 255.0)));
+                }
+            }
+        }, s.tileAp);
+}
+
+/*
+ * Fixed-point version of process_image for 8-bit input.
+ *
+ * The gaussian weights are rounded to Q14 and the rounding error is folded
+ * into the centre tap, so they sum to exactly 1<<14 and a flat image stays
+ * flat. The blur keeps 4 fractional bits in 16-bit channels (<= 255<<4).
+ * Prewitt works on r+g+b of those channels, 3*16 = 48 units per input
+ * step, and the magnitude floor(sqrt(Gx^2+Gy^2)/48) is found by a binary
+ * search over squared thresholds, so no sqrt or division is needed.
+ *
+ * Taps outside the image contribute nothing, as in the double path; the
+ * input and intensity planes are zero padded so the inner loops have no
+ * bounds checks and walk contiguous rows.
+ */
+void process_image_fixed(const Mat& image, Mat& dest, scratch& s) {
+	const int rows = image.rows;
+	const int cols = image.cols;
+	const int r = blurRadius;
+	const int dim = 2*r + 1;
+	const int shift = 14;
+
+	// Q14 weights, kernel[kx + ky*dim] applies to pixel (i+kx-r, j+ky-r)
+	double kernel[dim*dim];
+	gaussian_kernel(dim, dim, blurStddev, kernel);
+	uint32_t weights[dim*dim];
+	int32_t residual = 1 << shift;
+	for(int k = 0; k < dim*dim; ++k) {
+		weights[k] = (uint32_t)lround(kernel[k] * (1 << shift));
+		residual -= weights[k];
+	}
+	weights[r + r*dim] += residual;
+
+	// thresholds[v] = (48v)^2, so the output is the largest v with thresholds[v] <= Gx^2+Gy^2
+	uint32_t thresholds[256];
+	for(int v = 0; v < 256; ++v) {
+		thresholds[v] = (uint32_t)(48*v) * (uint32_t)(48*v);
+	}
+
+	const int prow = (cols + 2*r) * 3;
+	s.padded.assign((size_t)(rows + 2*r) * prow, 0);
+	s.blurred16.resize((size_t)rows * cols * 3);
+	s.intensity.assign((size_t)(rows + 2) * (cols + 2), 0);
+	uint8_t * const padded = s.padded.data();
+	uint16_t * const blurred16 = s.blurred16.data();
+	uint16_t * const intensity = s.intensity.data();
+	const int irow = cols + 2;
+	tbb::enumerable_thread_specific<std::vector<uint32_t> >& blurAcc = s.blurAcc;
+
+	tbb::parallel_for (
+		tbb::blocked_range<int> ( 0, rows, grain ),
+		[=, &image](const tbb::blocked_range<int>& b) {
+			for( int i = b.begin(); i < b.end(); ++i ) {
+				memcpy(padded + (size_t)(i + r) * prow + 3*r, image.ptr<uint8_t>(i), (size_t)cols * 3);
+			}
+		}, s.padAp);
+
+	// blur: one pass per tap over a contiguous run of channel bytes
+	tbb::parallel_for (
+		tbb::blocked_range2d<int> ( 0, rows, grain, 0, cols, grain ),
+		[=, &weights, &blurAcc](const tbb::blocked_range2d<int>& b) {
+			const int jb = b.cols().begin();
+			const int width = (b.cols().end() - jb) * 3;
+			// tiles are about grain wide, so this only grows on a thread's first tiles
+			std::vector<uint32_t>& accBuffer = blurAcc.local();
+			if(accBuffer.size() < (size_t)width) {
+				accBuffer.resize(width);
+			}
+			uint32_t * const acc = accBuffer.data();
+			for( int i = b.rows().begin(); i < b.rows().end(); ++i ) {
+				std::fill(acc, acc + width, 0);
+				for( int kx = 0; kx < dim; ++kx ) {
+					const uint8_t * const in = padded + (size_t)(i + kx) * prow + 3*jb;
+					for( int ky = 0; ky < dim; ++ky ) {
+						const uint32_t w = weights[kx + ky*dim];
+						const uint8_t * const tap = in + 3*ky;
+						for( int c = 0; c < width; ++c ) {
+							acc[c] += w * tap[c];
+						}
+					}
+				}
+				uint16_t * const out = blurred16 + ((size_t)i * cols + jb) * 3;
+				for( int c = 0; c < width; ++c ) {
+					out[c] = (uint16_t)((acc[c] + (1 << (shift - 5))) >> (shift - 4));
+				}
+			}
+		}, s.tile16Ap);
+
+	tbb::parallel_for (
+		tbb::blocked_range<int> ( 0, rows, grain ),
+		[=](const tbb::blocked_range<int>& b) {
+			for( int i = b.begin(); i < b.end(); ++i ) {
+				const uint16_t * const in = blurred16 + (size_t)i * cols * 3;
+				uint16_t * const out = intensity + (size_t)(i + 1) * irow + 1;
+				for( int j = 0; j < cols; ++j ) {
+					out[j] = in[3*j] + in[3*j + 1] + in[3*j + 2];
+				}
+			}
+		}, s.intensityAp);
+
+	// Prewitt: X is (row below - row above), Y is (column left - column right)
+	dest.create(rows, cols, CV_8UC3);
+	tbb::parallel_for (
+		tbb::blocked_range2d<int> ( 0, rows, grain, 0, cols, grain ),
+		[=, &dest, &thresholds](const tbb::blocked_range2d<int>& b) {
+			for( int i = b.rows().begin(); i < b.rows().end(); ++i ) {
+				const uint16_t * const above = intensity + (size_t)i * irow;
+				const uint16_t * const here = above + irow;
+				const uint16_t * const below = here + irow;
+				uint8_t * const out = dest.ptr<uint8_t>(i);
+				for( int j = b.cols().begin(); j < b.cols().end(); ++j ) {
+					const int32_t gx = (below[j] + below[j+1] + below[j+2]) - (above[j] + above[j+1] + above[j+2]);
+					const int32_t gy = (above[j] + here[j] + below[j]) - (above[j+2] + here[j+2] + below[j+2]);
+					const uint32_t mag = (uint32_t)(gx*gx) + (uint32_t)(gy*gy);
+					uint32_t v = 0;
+					for( uint32_t step = 128; step > 0; step >>= 1 ) {
+						v += (thresholds[v + step] <= mag) ? step : 0;
+					}
+					out[3*j] = out[3*j + 1] = out[3*j + 2] = (uint8_t)v;
+				}
+			}
+		}, s.tile16Ap);
+}
+
+// Runs the precision path selected on the command line
+void process(const Mat& image, Mat& dest, scratch& s) {
+	if(fixedPoint) {
+		process_image_fixed(image, dest, s);
+	} else {
+		process_image(image, dest, s);
+	}
+}
+
+// Peak signal to noise ratio between two 8-bit images of the same size
+double psnr(const Mat& a, const Mat& b) {
+	double sse = 0.0;
+	for(int i = 0; i < a.rows; ++i) {
+		const uint8_t * const pa = a.ptr<uint8_t>(i);
+		const uint8_t * const pb = b.ptr<uint8_t>(i);
+		for(int c = 0; c < a.cols * 3; ++c) {
+			const double d = (double)pa[c] - (double)pb[c];
+			sse += d * d;
+		}
+	}
+	if(sse == 0.0) {
+		return INFINITY;
+	}
+	const double mse = sse / ((double)a.rows * a.cols * 3);
+	return 10.0 * log10((255.0 * 255.0) / mse);
+}
+
+/*
+ * Collects the images named by source: every regular file in it when it is
+ * a directory, otherwise one path per line of the file (blank lines skipped)
+ */
+bool list_images(const char* source, std::vector<std::string>& names) {
+	struct stat st;
+	if(stat(source, &st) != 0) {
+		return false;
+	}
+	if(S_ISDIR(st.st_mode)) {
+		DIR* dir = opendir(source);
+		if(dir == NULL) {
+			return false;
+		}
+		struct dirent* entry;
+		while((entry = readdir(dir)) != NULL) {
+			if(entry->d_name[0] == '.') {
+				continue;
+			}
+			std::string path = std::string(source) + "/" + entry->d_name;
+			if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+				names.push_back(path);
+			}
+		}
+		closedir(dir);
+		// readdir order is arbitrary, keep runs reproducible
+		std::sort(names.begin(), names.end());
+	} else {
+		std::ifstream list(source);
+		std::string line;
+		while(std::getline(list, line)) {
+			line.erase(line.find_last_not_of(" \t\r") + 1);
+			if(!line.empty()) {
+				names.push_back(line);
+			}
+		}
+	}
+	return true;
+}
+
+/*
+ * The output path of every image in names: outDir plus the input's file
+ * name. Fails, naming the clash, when two inputs have the same file name,
+ * since one would overwrite the other.
+ */
+bool output_names(const std::vector<std::string>& names, const std::string& outDir, std::vector<std::string>& outNames) {
+	std::set<std::string> seen;
+	for(size_t i = 0; i < names.size(); ++i) {
+		size_t slash = names[i].find_last_of('/');
+		const std::string base = slash == std::string::npos ? names[i] : names[i].substr(slash + 1);
+		if(!seen.insert(base).second) {
+			std::cerr << "Two inputs are named " << base << ", the second would overwrite the first in " << outDir << std::endl;
+			return false;
+		}
+		outNames.push_back(outDir + "/" + base);
+	}
+	return true;
+}
+
+// One image in flight through the batch pipeline
+struct batch_item {
+	std::string inName;
+	std::string outName;
+	Mat image;
+	Mat dest;
+};
+
+/*
+ * Runs every image in names through a bounded decode -> stencil -> encode
+ * pipeline, writing each result to the same position in outNames.
+ * Decode and encode are parallel stages so codec and disk time overlap
+ * with the stencil of other images; at most ntoken images are in flight,
+ * so ntoken scratch buffers cover every concurrent stencil and taking one
+ * never waits.
+ * Returns the number of images that could not be read or written.
+ */
+int process_batch(const std::vector<std::string>& names, const std::vector<std::string>& outNames) {
+	const size_t ntoken = std::max(2u, std::thread::hardware_concurrency());
+	std::vector<scratch> scratches(ntoken);
+	tbb::concurrent_bounded_queue<scratch*> freeScratch;
+	for(size_t k = 0; k < ntoken; ++k) {
+		freeScratch.push(&scratches[k]);
+	}
+	tbb::atomic<int> failures;
+	failures = 0;
+	size_t next = 0;
+
+    tbb::parallel_pipeline (
+        ntoken,
+        tbb::make_filter<void,batch_item*>(
+            tbb::filter::serial_in_order,
+            [&]( tbb::flow_control& fc ) -> batch_item* {
+                if( next == names.size() ) {
+                    fc.stop();
+                    return NULL;
+                }
+                batch_item* item = new batch_item;
+                item->inName = names[next];
+                item->outName = outNames[next++];
+                return item;
             }
-        });
+        ) &
+        tbb::make_filter<batch_item*,batch_item*>(
+            tbb::filter::parallel,
+            [&]( batch_item* item ) -> batch_item* {
+                item->image = imread(item->inName, CV_LOAD_IMAGE_COLOR);
+                if( !item->image.data ) {
+                    std::cerr << "Error opening " << item->inName << std::endl;
+                    failures++;
+                }
+                return item;
+            }
+        ) &
+        tbb::make_filter<batch_item*,batch_item*>(
+            tbb::filter::parallel,
+            [&]( batch_item* item ) -> batch_item* {
+                if( item->image.data ) {
+                    scratch* s;
+                    freeScratch.pop(s);
+                    process(item->image, item->dest, *s);
+                    freeScratch.push(s);
+                    item->image.release();
+                }
+                return item;
+            }
+        ) &
+        tbb::make_filter<batch_item*,void>(
+            tbb::filter::parallel,
+            [&]( batch_item* item ) {
+                if( item->dest.data && !imwrite(item->outName, item->dest) ) {
+                    std::cerr << "Error writing " << item->outName << std::endl;
+                    failures++;
+                }
+                delete item;
+            }
+        )
+    );
+	return failures;
 }
 
 int main( int argc, char* argv[] ) {
     double start, end;
 
-	if(argc != 2) {
-		std::cerr << "Usage: " << argv[0] << " imageName\n";
+	bool batch = false, compare = false, badArgs = false;
+	int opt;
+	while((opt = getopt(argc, argv, "bp:ck:e:a")) != -1) {
+		switch(opt) {
+			case 'b': batch = true; break;
+			case 'c': compare = true; break;
+			case 'k':
+			case 'e':
+			case 'a':
+				badArgs = badArgs || !parse_kernel_option(opt, optarg, kernels);
+				break;
+			case 'p':
+				if(std::string(optarg) == "fixed") { fixedPoint = true; break; }
+				if(std::string(optarg) == "double") { fixedPoint = false; break; }
+				// fall through
+			default:
+				badArgs = true;
+		}
+	}
+	const int nargs = batch ? 2 : 1;
+	if(compare && batch) {
+		std::cerr << "-c compares one image and cannot be combined with -b\n";
+		badArgs = true;
+	}
+	if((fixedPoint || compare) && kernels.custom()) {
+		std::cerr << "The fixed-point path only supports the built-in kernels\n";
+		badArgs = true;
+	}
+	if(badArgs || (argc - optind != nargs && argc - optind != nargs + 1) || !check_kernel_options(kernels, blurRadius, blurStddev)) {
+		std::cerr << "Usage: " << argv[0] << " [-p double|fixed] [-c] [-k spec] [-e spec] [-a] imageName [grain]\n"
+		          << "       " << argv[0] << " [-p double|fixed] [-k spec] [-e spec] [-a] -b <listFile|imageDir> outDir [grain]\n"
+		          << "  -c compares the fixed-point output against the double path (PSNR)\n"
+		          << kernel_usage;
 		return 1;
 	}    
+	if(argc - optind == nargs + 1) {
+		grain = atoi(argv[optind + nargs]);
+		if(grain < 1) {
+			std::cerr << "Grain must be a positive integer\n";
+			return 1;
+		}
+	}
+
+	if(batch) {
+		std::vector<std::string> names;
+		if(!list_images(argv[optind], names)) {
+			std::cerr << "Error listing " << argv[optind] << std::endl;
+			return -1;
+		}
+		std::vector<std::string> outNames;
+		if(!output_names(names, argv[optind + 1], outNames)) {
+			return -1;
+		}
+		start = omp_get_wtime();
+		int failures = process_batch(names, outNames);
+		end = omp_get_wtime();
+		printf( "ptime = %lf (%d images, %d failed)\n", end - start, (int)names.size(), failures );
+		return failures == 0 ? 0 : -1;
+	}
 
 	// Read image
 	Mat image;
-	image = imread(argv[1], CV_LOAD_IMAGE_COLOR);
+	image = imread(argv[optind], CV_LOAD_IMAGE_COLOR);
 	if(!image.data ) {
-		std::cout <<  "Error opening " << argv[1] << std::endl;
+		std::cout <<  "Error opening " << argv[optind] << std::endl;
 		return -1;
 	}
 	
+	// process sizes the output image to match the input
+	Mat dest;
+	scratch s;
+
+	if(compare) {
+		Mat reference;
+		start = omp_get_wtime();
+		process_image(image, reference, s);
+		end = omp_get_wtime();
+		printf( "double ptime = %lf\n", end - start );
+		start = omp_get_wtime();
+		process_image_fixed(image, dest, s);
+		end = omp_get_wtime();
+		printf( "fixed  ptime = %lf\n", end - start );
+		printf( "fixed vs double PSNR = %.2lf dB\n", psnr(reference, dest) );
+		imwrite("out.jpg", fixedPoint ? dest : reference);
+		return 0;
+	}
+
     start = omp_get_wtime();
 
-	// Get image into C array of doubles for processing
-	const int rows = image.rows;
-	const int cols = image.cols;
-	pixel * imagePixels = (pixel *) malloc(rows * cols * sizeof(pixel));
-    tbb::parallel_for (
-        tbb::blocked_range<int> ( 0, cols ),
-        [=](tbb::blocked_range<int> r) { 
-            for( int j = r.begin(); j < r.end(); ++j ) {
-                tbb::parallel_for (
-                    tbb::blocked_range<int> ( 0, rows ),
-                    [=](tbb::blocked_range<int> r2) { 
-                        for( int i = r2.begin(); i < r2.end(); ++i ) {
-                            Vec3b p = image.at<Vec3b>(i, j);
-                            imagePixels[i + (j*rows)] = pixel(p[0]/255.0,p[1]/255.0,p[2]/255.0);
-                        }
-                    });
-            }
-        });
-	
-	// Create output arrays
-	pixel * blurred = (pixel *) malloc(rows * cols * sizeof(pixel));
-	pixel * outPixels = (pixel *) malloc(rows * cols * sizeof(pixel));
-    tbb::parallel_for (
-        tbb::blocked_range<int> ( 0, rows * cols ),
-        [=](tbb::blocked_range<int> r) { 
-            for( int i = r.begin(); i < r.end(); ++i ) {
-                blurred[i].red = 0.0;
-                blurred[i].green = 0.0;
-                blurred[i].blue = 0.0;
-                outPixels[i].red = 0.0;
-                outPixels[i].green = 0.0;
-                outPixels[i].blue = 0.0;
-	        }    
-        });
-
-	// Do the stencil
-	apply_stencil(3, 32.0, rows, cols, imagePixels, blurred);
-    
-    // Apply grayscale processing
-    apply_prewittKs(rows, cols, blurred, outPixels);
-	
-	// Create an output image (same size as input)
-	Mat dest(rows, cols, CV_8UC3);
-	// Copy C array back into image for output
-    tbb::parallel_for (
-        tbb::blocked_range<int> ( 0, cols ),
-        [=, &dest](tbb::blocked_range<int> r) { 
-            for( int j = r.begin(); j < r.end(); ++j ) {
-                tbb::parallel_for (
-                    tbb::blocked_range<int> ( 0, rows ),
-                    [=, &dest](tbb::blocked_range<int> r2) { 
-                        for( int i = r2.begin(); i < r2.end(); ++i ) {
-                            const size_t offset = i + (j*rows);
-                            dest.at<Vec3b>(i, j) = Vec3b(floor(outPixels[offset].red * 255.0),
-                                                         floor(outPixels[offset].green * 255.0),
-                                                         floor(outPixels[offset].blue * 255.0));
-                        }
-                    });
-            }
-        });
+	process(image, dest, s);
 	
 	imwrite("out.jpg", dest);
 	
     end = omp_get_wtime();
     printf( "ptime = %lf\n", end - start );
 	
-	free(imagePixels);
-	free(blurred);
-	free(outPixels);
 	return 0;
 }
-
-
-
-
-
@@ -11,7 +11,8 @@
 #    0, 100
 #    0, -100
 
-time ./starhole_cilk 10000 100 200 100 0 -100 0 0 100 0 -100
+# ENGINE=philox or ENGINE=batch ./run.sh selects the walker engine
+time ./starhole_cilk -e ${ENGINE:-drand48} 10000 100 200 100 0 -100 0 0 100 0 -100
 
 # Execution time of the serial version is roughly 26 seconds on a nuc
 #Attempting to setup initial state...
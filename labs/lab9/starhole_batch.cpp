@@ -0,0 +1,309 @@
+#ifndef STARHOLE_BATCH
+#define STARHOLE_BATCH
+/*
+ * Batched particle engine (-e batch)
+ *
+ * Instead of one recursive walk per particle, the live particles are kept
+ * in structure-of-arrays buffers and are all advanced together, so the
+ * depth of a split chain no longer matters. The random bits are the
+ * counter based ones of philoxWalker(), so the histogram is identical to
+ * -e philox.
+ *
+ * An iteration works on fixed blocks of BATCH_BLOCK particles:
+ *     1. every particle takes up to BATCH_STEPS steps, stopping after a
+ *        split; a block counts the particles it keeps (those with steps
+ *        left and their children)
+ *     2. exclusive prefix sum of the block counts
+ *     3. every block copies what it keeps to its offset in the next buffers
+ * Particles are recorded in the histogram as they run out of steps. Root
+ * particles are admitted while fewer than BATCH_LIVE are alive, so memory
+ * stays bounded whatever the amount.
+ *
+ * Step 1 moves a block's particles in lockstep (BatchLanes): one loop over
+ * the lanes per step, with the same straight-line body for every lane and
+ * the lanes that split or ran out masked out arithmetically, so the
+ * compiler can vectorize the philox rounds and the cell lookups (gathers,
+ * on targets that have them, e.g. AVX2). The lanes first take one step if
+ * their steps left are even, so that from then on two steps share a philox
+ * block, and the walking lanes are packed to the front whenever a quarter
+ * of them have stopped. The cell lookups read the CellRecord as 32 bit
+ * words, the width a gather loads.
+ *
+ * The blocks run on the program's parallel loop functor
+ *     pfor(begin, end, f)  calls f(b, e) on disjoint sub-ranges covering [begin, end)
+ * and slot() numbers the calling worker for the histogram. The walk starts
+ * from a BatchFrontier, empty or restored from a checkpoint, and calls
+ * onPass(f) with it after every pass.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+static const int BATCH_BLOCK = 256;
+// steps a particle takes in one pass unless it splits first
+static const int BATCH_STEPS = 1024;
+static const size_t BATCH_LIVE = 1 << 20;
+
+// A 32 bit word of a CellRecord, read by lanesStep() (little-endian layout)
+typedef uint32_t __attribute__((may_alias)) CellWord;
+static_assert(sizeof(CellRecord) == 32 && offsetof(CellRecord, dir) == 4 && offsetof(DirAlias, alias) == 18,
+              "lanesStep() reads a CellRecord as split, thresholds from word 1 and aliases from byte 22");
+
+// A block's particles while they step in lockstep; at[i] is lane i's particle
+typedef struct _batchLanes {
+    int x[BATCH_BLOCK];
+    int y[BATCH_BLOCK];
+    int steps[BATCH_BLOCK];
+    int split[BATCH_BLOCK];
+    int dir[BATCH_BLOCK];       // direction of the last step
+    int offset[BATCH_BLOCK];    // cell the last step was taken from
+    uint32_t idLo[BATCH_BLOCK];
+    uint32_t idHi[BATCH_BLOCK];
+    uint32_t bits[4][BATCH_BLOCK];
+    size_t at[BATCH_BLOCK];
+    int n;
+} BatchLanes;
+
+// The philox block of every lane's next step, steps left / 2
+static inline void lanesDraw(BatchLanes* L) {
+    for(int i=0;i<L->n;i++) {
+        const Philox4x32 r = philox4x32_10((uint32_t)(L->steps[i] >> 1), 0, L->idLo[i], L->idHi[i],
+                                           PHILOX_KEY0, PHILOX_KEY1);
+        L->bits[0][i] = r.v[0];
+        L->bits[1][i] = r.v[1];
+        L->bits[2][i] = r.v[2];
+        L->bits[3][i] = r.v[3];
+    }
+}
+
+/*
+ * One step of every lane that is still walking (and, with evenOnly, has an
+ * even number of steps left), from bits[half] and bits[half+1] as
+ * stepBits() would give them. Returns the number of lanes that stepped.
+ */
+static inline int lanesStep(BatchLanes* L, const CellRecord* cells, int radius, int half, bool evenOnly) {
+    const int side = 2 * radius + 1;
+    const CellWord* words = (const CellWord*)cells;
+    const uint32_t* lo = L->bits[half];
+    const uint32_t* hi = L->bits[half + 1];
+    int walked = 0;
+    for(int i=0;i<L->n;i++) {
+        // every load is made for every lane, and mask = act ? ~0 : 0 keeps the stopped lanes as they are
+        const int act = (L->steps[i] > 0) & (L->split[i] == 0) & (!evenOnly | ((L->steps[i] & 1) == 0));
+        const int mask = -act;
+        const int offset = (L->x[i] + radius) + (L->y[i] + radius) * side;
+        // the record as eight 32 bit words, since gathers load words: split, then the
+        // thresholds two to a word from word 1, then the aliases four to a word from byte 22
+        const int record = 8 * offset;
+        const int split = lo[i] < words[record];
+        const uint64_t m = (uint64_t)hi[i] * 9;
+        const int col = (int)(m >> 32);
+        const int threshold = (int)((words[record + 1 + (col >> 1)] >> (16 * (col & 1))) & 0xffff);
+        const int alias = (int)((words[record + ((22 + col) >> 2)] >> (8 * ((22 + col) & 3))) & 0xff);
+        const int k = (int)((uint32_t)m >> 16) < threshold ? col : alias;
+        L->x[i] += dirX[k] & mask;
+        L->y[i] += dirY[k] & mask;
+        L->steps[i] -= act;
+        L->split[i] |= split & act;
+        L->dir[i] += (k - L->dir[i]) & mask;
+        L->offset[i] += (offset - L->offset[i]) & mask;
+        walked += act;
+    }
+    return walked;
+}
+
+typedef struct _particleSoA {
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> steps;
+    std::vector<uint64_t> id;
+} ParticleSoA;
+
+static void soaResize(ParticleSoA* p, size_t n) {
+    p->x.resize(n);
+    p->y.resize(n);
+    p->steps.resize(n);
+    p->id.resize(n);
+}
+
+// Where a batch walk stands between passes
+typedef struct _batchFrontier {
+    ParticleSoA live;       // the first n are alive
+    size_t n;
+    int nextRoot;           // roots before this one have been admitted
+    long particleSteps;
+} BatchFrontier;
+
+/*
+ * Walks amount particles from each of the coordPairs emitters for
+ * sim_steps steps, returning the number of particle-steps taken.
+ */
+template<typename ParallelFor, typename PassHook>
+long batchWalk(const ParallelFor& pfor, int (*slot)(), Histogram* hist,
+               const int* coords, int coordPairs, int amount, int sim_steps,
+               CellRecord* cells, int radius, BatchFrontier* f, const PassHook& onPass) {
+    ParticleSoA& cur = f->live;
+    ParticleSoA next;
+    std::vector<uint64_t> childIds;
+    std::vector<unsigned char> move;   // direction taken, | 16 when the particle split
+    std::vector<size_t> blockStart;
+    std::vector<long> stepsTaken;
+    const int roots = coordPairs * amount;
+    int& nextRoot = f->nextRoot;
+    size_t& n = f->n;
+    long& particleSteps = f->particleSteps;
+
+    while(n > 0 || nextRoot < roots) {
+        // Admit root particles up to the live limit
+        if(nextRoot < roots && n < BATCH_LIVE) {
+            const size_t admit = BATCH_LIVE - n < (size_t)(roots - nextRoot) ? BATCH_LIVE - n : (size_t)(roots - nextRoot);
+            soaResize(&cur, n + admit);
+            for(size_t i=0;i<admit;i++,nextRoot++) {
+                const int e = nextRoot / amount;
+                cur.x[n+i] = coords[2*e];
+                cur.y[n+i] = coords[2*e+1];
+                cur.steps[n+i] = sim_steps;
+                cur.id[n+i] = rootId(e, nextRoot % amount);
+            }
+            if(sim_steps == 0) {
+                for(size_t i=0;i<admit;i++) {
+                    histogramAdd(hist, slot(), toOffset(cur.x[n+i], cur.y[n+i], radius));
+                }
+                continue;
+            }
+            n += admit;
+        }
+        // 1. Step every particle
+        const int blocks = (int)((n + BATCH_BLOCK - 1) / BATCH_BLOCK);
+        childIds.resize(n);
+        move.resize(n);
+        blockStart.resize(blocks + 1);
+        stepsTaken.resize(blocks);
+        pfor(0, blocks, [&](int bb, int be) {
+            const int s = slot();
+            BatchLanes lanes;
+            for(int b=bb;b<be;b++) {
+                const size_t lo = (size_t)b * BATCH_BLOCK;
+                const size_t hi = lo + BATCH_BLOCK < n ? lo + BATCH_BLOCK : n;
+                size_t kept = 0;
+                long taken = 0;
+                // a lane that has stopped goes back to its particle, and the block counts what it keeps
+                auto retire = [&](int i) {
+                    const size_t p = lanes.at[i];
+                    const int steps = lanes.steps[i], split = lanes.split[i];
+                    if(split) {
+                        // steps was decremented after the split step
+                        childIds[p] = childId(cur.id[p], steps + 1);
+                    }
+                    cur.x[p] = lanes.x[i];
+                    cur.y[p] = lanes.y[i];
+                    cur.steps[p] = steps;
+                    move[p] = (unsigned char)(lanes.dir[i] | (split << 4));
+                    if(steps > 0) {
+                        kept += 1 + split;
+                    } else {
+                        // the particle and any child it made on its last step are done
+                        histogramAdd(hist, s, toOffset(lanes.x[i], lanes.y[i], radius));
+                        if(split) {
+                            histogramAdd(hist, s, lanes.offset[i]);
+                        }
+                    }
+                };
+                lanes.n = (int)(hi - lo);
+                for(int i=0;i<lanes.n;i++) {
+                    const size_t p = lo + i;
+                    lanes.x[i] = cur.x[p];
+                    lanes.y[i] = cur.y[p];
+                    lanes.steps[i] = cur.steps[p];
+                    lanes.split[i] = 0;
+                    lanes.dir[i] = 4;
+                    lanes.offset[i] = 0;
+                    lanes.idLo[i] = (uint32_t)cur.id[p];
+                    lanes.idHi[i] = (uint32_t)(cur.id[p] >> 32);
+                    lanes.at[i] = p;
+                }
+                // even steps left read the low half of their block, then every pair of steps shares one
+                lanesDraw(&lanes);
+                taken += lanesStep(&lanes, cells, radius, 0, true);
+                for(int t=1;t+2<=BATCH_STEPS && lanes.n>0;t+=2) {
+                    lanesDraw(&lanes);
+                    taken += lanesStep(&lanes, cells, radius, 2, false);
+                    const int walked = lanesStep(&lanes, cells, radius, 0, false);
+                    taken += walked;
+                    if(4 * walked < 3 * lanes.n) {
+                        // pack the walking lanes to the front
+                        int w = 0;
+                        for(int i=0;i<lanes.n;i++) {
+                            if(lanes.steps[i] > 0 && !lanes.split[i]) {
+                                if(w != i) {
+                                    lanes.x[w] = lanes.x[i];
+                                    lanes.y[w] = lanes.y[i];
+                                    lanes.steps[w] = lanes.steps[i];
+                                    lanes.split[w] = 0;
+                                    lanes.dir[w] = lanes.dir[i];
+                                    lanes.offset[w] = lanes.offset[i];
+                                    lanes.idLo[w] = lanes.idLo[i];
+                                    lanes.idHi[w] = lanes.idHi[i];
+                                    lanes.at[w] = lanes.at[i];
+                                }
+                                w++;
+                            } else {
+                                retire(i);
+                            }
+                        }
+                        lanes.n = w;
+                    }
+                }
+                for(int i=0;i<lanes.n;i++) {
+                    retire(i);
+                }
+                stepsTaken[b] = taken;
+                blockStart[b+1] = kept;
+            }
+        });
+
+        // 2. Block offsets
+        blockStart[0] = 0;
+        for(int b=0;b<blocks;b++) {
+            blockStart[b+1] += blockStart[b];
+            particleSteps += stepsTaken[b];
+        }
+        const size_t nextN = blockStart[blocks];
+        soaResize(&next, nextN < BATCH_LIVE ? BATCH_LIVE : nextN);
+
+        // 3. Compact survivors and their children into next
+        pfor(0, blocks, [&](int bb, int be) {
+            for(int b=bb;b<be;b++) {
+                const size_t lo = (size_t)b * BATCH_BLOCK;
+                const size_t hi = lo + BATCH_BLOCK < n ? lo + BATCH_BLOCK : n;
+                size_t out = blockStart[b];
+                for(size_t i=lo;i<hi;i++) {
+                    const int steps = cur.steps[i];
+                    if(steps == 0) {
+                        continue;
+                    }
+                    next.x[out] = cur.x[i];
+                    next.y[out] = cur.y[i];
+                    next.steps[out] = steps;
+                    next.id[out] = cur.id[i];
+                    out++;
+                    if(move[i] & 16) {
+                        // the child starts where the parent stood, with the parent's steps left
+                        const int k = move[i] & 15;
+                        next.x[out] = cur.x[i] - dirX[k];
+                        next.y[out] = cur.y[i] - dirY[k];
+                        next.steps[out] = steps;
+                        next.id[out] = childIds[i];
+                        out++;
+                    }
+                }
+            }
+        });
+        std::swap(cur, next);
+        n = nextN;
+        onPass(f);
+    }
+    return particleSteps;
+}
+#endif
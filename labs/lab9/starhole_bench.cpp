@@ -0,0 +1,161 @@
+/*
+ * Cost of a particle step with each field layout, splits left out:
+ *     drand48  two drand48_r draws; splitProb and the 72 byte DirUpdate
+ *              cascade, two arrays (-e drand48)
+ *     alias    a philox block per step; splitProb and a 28 byte DirAlias,
+ *              two arrays
+ *     fused    a philox block per two steps, 64 bits a step; one 32 byte
+ *              CellRecord per cell, one array (-e philox, -e batch)
+ * PARTICLES particles spread over the field take turns stepping, so the
+ * loads scatter over the field the way a full run's do.
+ *
+ *     ./starhole_bench [steps] [radius ...]
+ */
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstdint>
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+using namespace cv;
+
+#include "starhole_common.cpp"
+
+static const int PARTICLES = 4096;
+
+struct serial_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        f(begin, end);
+    }
+};
+
+// Start positions: uniform over the cells at least two in from the edge
+static void startPositions(int radius, std::vector<int>& sx, std::vector<int>& sy) {
+    sx.resize(PARTICLES);
+    sy.resize(PARTICLES);
+    for(int p=0, n=0; p<PARTICLES; n++) {
+        const Philox4x32 r = philox4x32_10(n, 2, 0, 0, PHILOX_KEY0, PHILOX_KEY1);
+        const int x = (int)(r.v[0] % (2*radius+1)) - radius;
+        const int y = (int)(r.v[1] % (2*radius+1)) - radius;
+        if(dist(x,y) < radius - 2) {
+            sx[p] = x;
+            sy[p] = y;
+            p++;
+        }
+    }
+}
+
+double benchDrand48(int radius, int steps, std::vector<int> x, std::vector<int> y, long* splits) {
+    int* outArea;
+    double* splitProb;
+    DirUpdate* area;
+    initialize(serial_for(),radius,&outArea,&splitProb,&area,NULL);
+    std::vector<struct drand48_data> seeds(PARTICLES);
+    for(int p=0;p<PARTICLES;p++) {
+        srand48_r(p, &seeds[p]);
+    }
+    const double start = wallTime();
+    for(int s=0;s<steps;s++) {
+        for(int p=0;p<PARTICLES;p++) {
+            *splits += doesSplit(&seeds[p], splitProb, x[p], y[p], radius);
+            updateLocation(&seeds[p], area, &x[p], &y[p], radius);
+        }
+    }
+    const double elapsed = wallTime() - start;
+    free(outArea);
+    free(splitProb);
+    free(area);
+    return elapsed;
+}
+
+double benchAlias(int radius, int steps, std::vector<int> x, std::vector<int> y, long* splits) {
+    const int cells = (2*radius+1)*(2*radius+1);
+    std::vector<double> splitProb(cells);
+    std::vector<DirAlias> dirs(cells);
+    for(int i=-radius;i<radius+1;i++) {
+        for(int j=-radius;j<radius+1;j++) {
+            const int offset = toOffset(i,j,radius);
+            splitProb[offset] = computeSplitProb(i,j,radius);
+            DirUpdate d;
+            computeDirProb(i,j,radius,&d);
+            buildDirAlias(&d,&dirs[offset]);
+        }
+    }
+    const double start = wallTime();
+    for(int s=0;s<steps;s++) {
+        for(int p=0;p<PARTICLES;p++) {
+            const Philox4x32 r = philox4x32_10(steps-s, 0, p, 0, PHILOX_KEY0, PHILOX_KEY1);
+            const int offset = toOffset(x[p],y[p],radius);
+            *splits += philoxUniform(r.v[0]) < splitProb[offset];
+            const int k = aliasDir(dirs[offset], r.v[1]);
+            x[p] += dirX[k];
+            y[p] += dirY[k];
+        }
+    }
+    return wallTime() - start;
+}
+
+double benchFused(int radius, int steps, std::vector<int> x, std::vector<int> y, long* splits) {
+    int* outArea;
+    CellRecord* cells;
+    initializeCells(serial_for(),radius,&outArea,&cells,NULL);
+    std::vector<StepBlock> blocks(PARTICLES);
+    for(int p=0;p<PARTICLES;p++) {
+        stepBlockReset(&blocks[p]);
+    }
+    const double start = wallTime();
+    for(int s=0;s<steps;s++) {
+        for(int p=0;p<PARTICLES;p++) {
+            const uint64_t bits = stepBits(p, steps-s, &blocks[p]);
+            const CellRecord& c = cells[toOffset(x[p],y[p],radius)];
+            *splits += cellSplits(c, bits);
+            cellMove(c, bits, &x[p], &y[p]);
+        }
+    }
+    const double elapsed = wallTime() - start;
+    free(outArea);
+    free(cells);
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    const int steps = argc > 1 ? atoi(argv[1]) : 2000;
+    std::vector<int> radii;
+    for(int i=2;i<argc;i++) {
+        radii.push_back(atoi(argv[i]));
+    }
+    if(radii.empty()) {
+        radii.push_back(100);
+        radii.push_back(5000);
+    }
+    if(steps < 1) {
+        printf("Usage: %s [steps] [radius ...]\n", argv[0]);
+        return 1;
+    }
+    printf("%d particles x %d steps, no splitting\n", PARTICLES, steps);
+    printf("radius  layout   bytes/cell  arrays  philox/step  ns/step\n");
+    const double stepCount = (double)PARTICLES * steps;
+    long splits = 0;
+    for(size_t i=0;i<radii.size();i++) {
+        const int radius = radii[i];
+        const double cells = (2.0*radius+1)*(2.0*radius+1);
+        std::vector<int> sx, sy;
+        startPositions(radius, sx, sy);
+        // DirUpdate for the whole field does not fit next to the others at large radii
+        if(cells * (sizeof(DirUpdate) + sizeof(double)) < 4e9) {
+            const double t = benchDrand48(radius, steps, sx, sy, &splits);
+            printf("%6d  drand48  %10d  %6d  %11s  %7.2f\n", radius, (int)(sizeof(DirUpdate) + sizeof(double)), 2, "-", t * 1e9 / stepCount);
+        } else {
+            printf("%6d  drand48  %10d  %6d  %11s  skipped, %.1f GB\n", radius, (int)(sizeof(DirUpdate) + sizeof(double)), 2, "-",
+                   cells * (sizeof(DirUpdate) + sizeof(double)) / 1e9);
+        }
+        double t = benchAlias(radius, steps, sx, sy, &splits);
+        printf("%6d  alias    %10d  %6d  %11.1f  %7.2f\n", radius, (int)(sizeof(DirAlias) + sizeof(double)), 2, 1.0, t * 1e9 / stepCount);
+        t = benchFused(radius, steps, sx, sy, &splits);
+        printf("%6d  fused    %10d  %6d  %11.1f  %7.2f\n", radius, (int)sizeof(CellRecord), 1, 0.5, t * 1e9 / stepCount);
+    }
+    printf("(%ld split draws)\n", splits);
+    return 0;
+}
@@ -0,0 +1,354 @@
+#ifndef STARHOLE_CHECKPOINT
+#define STARHOLE_CHECKPOINT
+/*
+ * Checkpoint/restart and progress for long runs (-C, -R, -P)
+ *
+ * The walks are cut where no walker is in flight: the recursive engines
+ * walk the roots in waves of consecutive roots, and -e batch stops between
+ * passes. There the per worker counts are merged into outArea and, every -i
+ * seconds, written to the -C file with the frontier of the run:
+ *     the next root to start (every root before it is done or, for -e batch,
+ *     admitted), the particle-steps and -e drand48 particle count so far,
+ *     and for -e batch the live particles (position, steps left, id)
+ * -R resumes from the file. The file also holds the run's parameters, and a
+ * restart with other parameters is refused. Roots keep their seeds or ids
+ * however the run is cut, so a resumed run ends with the same histogram as
+ * an uninterrupted one.
+ *
+ * The progress reporter is a thread that wakes every -P seconds and reads
+ * the per worker step counts without locking, so the walkers do no extra
+ * work for it. The estimated total comes from the waves or passes: for the
+ * recursive engines the work of the done roots scaled to all of them, for
+ * -e batch the steps done and left to the live particles per admitted root,
+ * which does not foresee later splits and runs low early on.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+
+static const uint32_t CHECKPOINT_MAGIC = 0x50434853;    // "SHCP"
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+typedef struct _checkpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t engine;
+    int32_t radius;
+    int32_t sim_steps;
+    int32_t amount;
+    int32_t coordPairs;
+    int32_t nextRoot;
+    int32_t particles;
+    int32_t pad;
+    int64_t particleSteps;
+    uint64_t live;          // -e batch particles in the frontier
+} CheckpointHeader;
+
+typedef struct _progress {
+    double every;               // seconds between reports
+    double start;
+    long startSteps;            // steps already done when the run started (restart)
+    StepCount* counts;          // live per worker counts, NULL for -e batch
+    int slots;
+    pthread_mutex_t lock;       // guards the fields below
+    pthread_cond_t wake;
+    long markSteps;             // steps at the last wave or pass
+    long markTotal;             // estimated total steps then, 0 before the first
+    bool stop;
+    pthread_t thread;
+} Progress;
+
+// Everything main() and the engines share about cutting up the run
+typedef struct _runControl {
+    const SimOptions* opts;
+    int engine;
+    int radius;
+    int sim_steps;
+    int amount;
+    int coordPairs;
+    const int* coords;
+    int roots;
+    int wave;                   // roots per wave, all of them with no -C or -P
+    int nextRoot;
+    int particles;              // -e drand48 particles of the done roots
+    int* outArea;
+    Histogram* hist;
+    StepCount* counts;
+    int slots;
+    double lastCheckpoint;
+    Progress progress;
+} RunControl;
+
+static void checkpointHeader(const RunControl* run, CheckpointHeader* h) {
+    h->magic = CHECKPOINT_MAGIC;
+    h->version = CHECKPOINT_VERSION;
+    h->engine = run->engine;
+    h->radius = run->radius;
+    h->sim_steps = run->sim_steps;
+    h->amount = run->amount;
+    h->coordPairs = run->coordPairs;
+    h->nextRoot = 0;
+    h->particles = 0;
+    h->pad = 0;
+    h->particleSteps = 0;
+    h->live = 0;
+}
+
+// Writes outArea and the frontier to the -C file, through a temporary file
+// so a crash while writing leaves the last checkpoint intact
+void checkpointWrite(const RunControl* run, long particleSteps, const ParticleSoA* live, size_t n) {
+    const char* path = run->opts->checkpoint;
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if(f == NULL) {
+        printf("Could not write checkpoint %s\n", tmp);
+        return;
+    }
+    CheckpointHeader h;
+    checkpointHeader(run, &h);
+    h.nextRoot = run->nextRoot;
+    h.particles = run->particles;
+    h.particleSteps = particleSteps;
+    h.live = n;
+    const size_t cells = (size_t)(2*run->radius+1)*(2*run->radius+1);
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+              && fwrite(run->coords, sizeof(int), 2*run->coordPairs, f) == (size_t)(2*run->coordPairs)
+              && fwrite(run->outArea, sizeof(int), cells, f) == cells;
+    if(ok && n > 0) {
+        ok = fwrite(&live->x[0], sizeof(int), n, f) == n
+             && fwrite(&live->y[0], sizeof(int), n, f) == n
+             && fwrite(&live->steps[0], sizeof(int), n, f) == n
+             && fwrite(&live->id[0], sizeof(uint64_t), n, f) == n;
+    }
+    ok = fclose(f) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0) {
+        printf("Could not write checkpoint %s\n", path);
+        remove(tmp);
+    }
+}
+
+// Loads the -C file into outArea and the run; false if it is missing, damaged
+// or from a run with other parameters
+bool checkpointRead(RunControl* run, long* particleSteps, ParticleSoA* live, size_t* n) {
+    const char* path = run->opts->checkpoint;
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        printf("Could not open checkpoint %s\n", path);
+        return false;
+    }
+    CheckpointHeader want, h;
+    checkpointHeader(run, &want);
+    std::vector<int> coords(2*run->coordPairs);
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == want.magic && h.version == want.version
+              && h.engine == want.engine && h.radius == want.radius && h.sim_steps == want.sim_steps
+              && h.amount == want.amount && h.coordPairs == want.coordPairs
+              && fread(&coords[0], sizeof(int), coords.size(), f) == coords.size();
+    for(size_t i=0;ok && i<coords.size();i++) {
+        ok = coords[i] == run->coords[i];
+    }
+    if(!ok) {
+        printf("Checkpoint %s is not from a run with these arguments\n", path);
+        fclose(f);
+        return false;
+    }
+    const size_t cells = (size_t)(2*run->radius+1)*(2*run->radius+1);
+    ok = fread(run->outArea, sizeof(int), cells, f) == cells;
+    if(ok && h.live > 0) {
+        soaResize(live, h.live);
+        ok = fread(&live->x[0], sizeof(int), h.live, f) == h.live
+             && fread(&live->y[0], sizeof(int), h.live, f) == h.live
+             && fread(&live->steps[0], sizeof(int), h.live, f) == h.live
+             && fread(&live->id[0], sizeof(uint64_t), h.live, f) == h.live;
+    }
+    fclose(f);
+    if(!ok) {
+        printf("Checkpoint %s is truncated\n", path);
+        return false;
+    }
+    run->nextRoot = h.nextRoot;
+    run->particles = h.particles;
+    *particleSteps = h.particleSteps;
+    *n = h.live;
+    return true;
+}
+
+static long progressSteps(Progress* p) {
+    if(p->counts == NULL) {
+        return p->markSteps;
+    }
+    long steps = 0;
+    for(int i=0;i<p->slots;i++) {
+        steps += ((volatile StepCount*)p->counts)[i].steps;
+    }
+    return steps;
+}
+
+static void* progressThread(void* arg) {
+    Progress* p = (Progress*)arg;
+    pthread_mutex_lock(&p->lock);
+    while(!p->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += (time_t)p->every;
+        until.tv_nsec += (long)((p->every - (time_t)p->every) * 1e9);
+        if(until.tv_nsec >= 1000000000L) {
+            until.tv_sec += 1;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&p->wake, &p->lock, &until);
+        if(p->stop) {
+            break;
+        }
+        const long steps = progressSteps(p);
+        const double elapsed = wallTime() - p->start;
+        const double rate = (steps - p->startSteps) / elapsed;
+        if(p->markTotal > 0 && rate > 0) {
+            const long left = p->markTotal > steps ? p->markTotal - steps : 0;
+            printf("progress: %ld particle-steps (%.1f%%), %.3g particle-steps/sec, ETA %.0f s\n",
+                   steps, 100.0 * steps / p->markTotal, rate, left / rate);
+        } else {
+            printf("progress: %ld particle-steps, %.3g particle-steps/sec\n", steps, rate);
+        }
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// A wave or pass is done: steps so far and the estimated total
+static inline void progressMark(Progress* p, long steps, long total) {
+    if(p->every <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->markSteps = steps;
+    p->markTotal = total;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Sets up the run before the walks. With -R the checkpoint is loaded into
+ * outArea, the step counts (or *batchSteps, live and *n for -e batch) and
+ * the run's frontier; returns false if it cannot be.
+ */
+bool runBegin(RunControl* run, const SimOptions* opts, int engine, int radius, int sim_steps, int amount,
+              int coordPairs, const int* coords, int* outArea, Histogram* hist, StepCount* counts,
+              long* batchSteps, ParticleSoA* live, size_t* n) {
+    run->opts = opts;
+    run->engine = engine;
+    run->radius = radius;
+    run->sim_steps = sim_steps;
+    run->amount = amount;
+    run->coordPairs = coordPairs;
+    run->coords = coords;
+    run->roots = coordPairs * amount;
+    run->nextRoot = 0;
+    run->particles = 0;
+    run->outArea = outArea;
+    run->hist = hist;
+    run->counts = counts;
+    run->slots = hist->slots;
+    run->wave = run->roots;
+    if(opts->checkpoint != NULL || opts->progress > 0) {
+        // about 64 waves, each enough roots to keep the workers busy
+        run->wave = run->roots / 64 > 16 * run->slots ? run->roots / 64 : 16 * run->slots;
+    }
+    *batchSteps = 0;
+    *n = 0;
+    if(opts->restart) {
+        long steps;
+        if(!checkpointRead(run, &steps, live, n)) {
+            return false;
+        }
+        if(engine == ENGINE_BATCH) {
+            *batchSteps = steps;
+        } else {
+            counts[0].steps = steps;
+        }
+        printf("Resuming from %s at root %d of %d\n", opts->checkpoint, run->nextRoot, run->roots);
+    }
+    run->lastCheckpoint = wallTime();
+
+    Progress* p = &run->progress;
+    p->every = opts->progress;
+    p->start = wallTime();
+    p->counts = engine == ENGINE_BATCH ? NULL : counts;
+    p->slots = run->slots;
+    p->startSteps = engine == ENGINE_BATCH ? *batchSteps : counts[0].steps;
+    p->markSteps = p->startSteps;
+    p->markTotal = 0;
+    p->stop = false;
+    if(p->every > 0) {
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->wake, NULL);
+        pthread_create(&p->thread, NULL, progressThread, p);
+    }
+    return true;
+}
+
+void runEnd(RunControl* run) {
+    Progress* p = &run->progress;
+    if(p->every > 0) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = true;
+        pthread_cond_signal(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->thread, NULL);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->wake);
+    }
+}
+
+// True when a checkpoint is due; the counts must then be merged first
+static inline bool checkpointDue(RunControl* run) {
+    return run->opts->checkpoint != NULL && wallTime() - run->lastCheckpoint >= run->opts->checkpointEvery;
+}
+
+/*
+ * Walks roots [nextRoot, roots) for the recursive engines: walk(lo, hi)
+ * walks roots [lo, hi) to the end, spawned children included, and returns
+ * the -e drand48 particle count. Between waves the run reports progress and
+ * checkpoints.
+ */
+template<typename ParallelFor, typename Walk>
+void walkRoots(const ParallelFor& pfor, RunControl* run, const Walk& walk) {
+    while(run->nextRoot < run->roots) {
+        const int lo = run->nextRoot;
+        const int hi = run->roots - lo > run->wave ? lo + run->wave : run->roots;
+        run->particles += walk(lo, hi);
+        run->nextRoot = hi;
+        const long steps = totalSteps(run->counts, run->slots);
+        progressMark(&run->progress, steps, (long)((double)steps * run->roots / hi));
+        if(hi < run->roots && checkpointDue(run)) {
+            histogramMerge(pfor, run->hist, run->outArea);
+            checkpointWrite(run, steps, NULL, 0);
+            run->lastCheckpoint = wallTime();
+        }
+    }
+}
+
+/*
+ * The -e batch pass hook: after each pass the run reports progress and
+ * checkpoints the live particles.
+ */
+template<typename ParallelFor>
+void batchPass(const ParallelFor& pfor, RunControl* run, const BatchFrontier* f) {
+    run->nextRoot = f->nextRoot;
+    if(run->progress.every > 0 && f->nextRoot > 0) {
+        long left = 0;
+        for(size_t i=0;i<f->n;i++) {
+            left += f->live.steps[i];
+        }
+        const double perRoot = (double)(f->particleSteps + left) / f->nextRoot;
+        progressMark(&run->progress, f->particleSteps, (long)(perRoot * run->roots));
+    }
+    if((f->n > 0 || f->nextRoot < run->roots) && checkpointDue(run)) {
+        histogramMerge(pfor, run->hist, run->outArea);
+        checkpointWrite(run, f->particleSteps, &f->live, f->n);
+        run->lastCheckpoint = wallTime();
+    }
+}
+#endif
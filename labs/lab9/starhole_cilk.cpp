@@ -5,28 +5,70 @@
 #include <stdio.h>
 #include <opencv2/opencv.hpp>
 #include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
 #include <cilk/reducer_opadd.h>
 
 using namespace cv;
 
 #include "starhole_common.cpp"
 
+// Histogram hooks: a few contiguous blocks of the range per worker, and the
+// Cilk worker number as the worker
+struct cilk_for_range {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        const int chunks = 4 * __cilkrts_get_nworkers();
+        cilk_for(int c = 0; c < chunks; ++c) {
+            const int b = begin + (int)((long)(end - begin) * c / chunks);
+            const int e = begin + (int)((long)(end - begin) * (c + 1) / chunks);
+            if(b < e) {
+                f(b, e);
+            }
+        }
+    }
+};
+
+static inline int workerSlot() {
+    return __cilkrts_get_worker_number();
+}
+
+static int workerSlots() {
+    return __cilkrts_get_nworkers();
+}
+
 // Represents the area in which the particles move
 static DirUpdate*   area;
 
+// Split thresholds and direction tables together, for the counter based engines
+static CellRecord*  cells;
+
 // Holds the split probabilities for Carter particles in cells
 static double*      splitProb;
 
 // Holds final counts of particles in cells
 static int* outArea;
 
+// Per worker counts, merged into outArea after the walks
+static Histogram hist;
+
+// Particle-steps walked per worker
+static StepCount* stepCounts;
+
+// Which splits get tasks of their own
+static SpawnPolicy spawnPolicy;
+
 // Configuration parameters
 static int radius;
 static int sim_steps;
 
+int walkerTask(long int seed, int x, int y, int stepsremaining, int depth);
+void philoxTask(uint64_t id, int x, int y, int stepsremaining, int depth);
+
 // Returns the total number of particles descending from this call
-// and increments the count at the right location
-int walker(long int seed, int x, int y, int stepsremaining) {
+// and increments the count at the right location. depth is the number of
+// spawns above the task this walk runs in, and clock times that task.
+int walker(long int seed, int x, int y, int stepsremaining, int depth, TaskClock* clock) {
+    stepCounts[workerSlot()].steps += stepsremaining;
+    clock->steps += stepsremaining;
     struct drand48_data seedbuf;
     srand48_r(seed, &seedbuf);
     cilk::reducer_opadd<int> particles( 1 );
@@ -37,9 +79,15 @@ int walker(long int seed, int x, int y, int stepsremaining) {
             //printf("spliting!\n");
             long int newseed;
             lrand48_r(&seedbuf, &newseed);
-            int parts = cilk_spawn walker(seed + newseed, x, y, stepsremaining-1);
-            cilk_sync;
-            particles += parts;
+            if(spawnChild(&spawnPolicy, workerSlot(), stepsremaining-1, depth)) {
+                taskClockPause(&spawnPolicy, clock);
+                int parts = cilk_spawn walkerTask(seed + newseed, x, y, stepsremaining-1, depth+1);
+                cilk_sync;
+                taskClockResume(&spawnPolicy, clock);
+                particles += parts;
+            } else {
+                particles += walker(seed + newseed, x, y, stepsremaining-1, depth, clock);
+            }
         }
         
         // Make the particle walk?
@@ -47,15 +95,64 @@ int walker(long int seed, int x, int y, int stepsremaining) {
     }
     
     // record the final location
-    outArea[toOffset(x,y,radius)] += 1;
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
     
     cilk_sync;
     return particles.get_value();
 }
 
+// Walks a particle as a task of its own
+int walkerTask(long int seed, int x, int y, int stepsremaining, int depth) {
+    TaskClock clock;
+    taskClockStart(&spawnPolicy, &clock);
+    const int particles = walker(seed, x, y, stepsremaining, depth, &clock);
+    taskClockStop(&spawnPolicy, workerSlot(), &clock);
+    return particles;
+}
+
+// Walks particle id and every particle that splits from it, recording
+// their final locations. A child's walk only depends on its id, so it is
+// spawned and left running; the implicit sync at return joins it.
+void philoxWalker(uint64_t id, int x, int y, int stepsremaining, int depth, TaskClock* clock) {
+    stepCounts[workerSlot()].steps += stepsremaining;
+    clock->steps += stepsremaining;
+    StepBlock block;
+    stepBlockReset(&block);
+    for( ; stepsremaining>0 ; stepsremaining-- ) {
+        const uint64_t bits = stepBits(id, stepsremaining, &block);
+        const CellRecord& c = cells[toOffset(x,y,radius)];
+        if(cellSplits(c, bits)) {
+            if(spawnChild(&spawnPolicy, workerSlot(), stepsremaining-1, depth)) {
+                taskClockPause(&spawnPolicy, clock);
+                cilk_spawn philoxTask(childId(id, stepsremaining), x, y, stepsremaining-1, depth+1);
+                taskClockResume(&spawnPolicy, clock);
+            } else {
+                philoxWalker(childId(id, stepsremaining), x, y, stepsremaining-1, depth, clock);
+            }
+        }
+        cellMove(c, bits, &x, &y);
+    }
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
+}
+
+void philoxTask(uint64_t id, int x, int y, int stepsremaining, int depth) {
+    TaskClock clock;
+    taskClockStart(&spawnPolicy, &clock);
+    philoxWalker(id, x, y, stepsremaining, depth, &clock);
+    taskClockStop(&spawnPolicy, workerSlot(), &clock);
+}
+
 int main(int argc, char** argv) {
-    if(argc<6 || ((argc-4)%2 != 0)) {
-        printf("Usage: %s <steps> <radius> <amount> <x1> <y1> ... <xN> <yN>\n",argv[0]);
+    const char* name = argv[0];
+    SimOptions opts;
+    const int first = readOptions(argc, argv, &opts);
+    // readArgs and the count check expect <steps> at argv[1]
+    if(first > 0) {
+        argc -= first - 1;
+        argv += first - 1;
+    }
+    if(first < 0 || argc<6 || ((argc-4)%2 != 0)) {
+        printUsage(name);
         return 1;
     }
 
@@ -66,24 +163,80 @@ int main(int argc, char** argv) {
     readArgs(argc, argv, &sim_steps, &radius, &amount, &coordPairs, &coords);
     
     // Initialize simulation lookups
-    initialize(radius,&outArea,&splitProb,&area);
+    if(opts.engine == ENGINE_DRAND48) {
+        initialize(cilk_for_range(),radius,&outArea,&splitProb,&area,opts.cacheDir);
+    } else {
+        initializeCells(cilk_for_range(),radius,&outArea,&cells,opts.cacheDir);
+    }
+    histogramInit(&hist, radius, workerSlots(), opts.histogram);
+    printf("Counting in %s histograms for %d workers\n", histogramModeName(hist.mode), hist.slots);
+    stepCounts = (StepCount*)callocLines(hist.slots, sizeof(StepCount));
+    spawnInit(&spawnPolicy, &opts, hist.slots);
     
     
     // Start initial walks
     printf("Starting the walks...\n");
+    RunControl run;
+    BatchFrontier frontier;
+    if(!runBegin(&run, &opts, opts.engine, radius, sim_steps, amount, coordPairs, coords, outArea, &hist, stepCounts,
+                 &frontier.particleSteps, &frontier.live, &frontier.n)) {
+        return 1;
+    }
+    frontier.nextRoot = run.nextRoot;
+    const long resumed = run.progress.startSteps;
+    const double start = wallTime();
     int totParticles = 0;
-    for(int i=0;i<coordPairs*2;i+=2) {
-        for(int j=0;j<amount;j++) {
-            totParticles += walker(i+j, coords[i], coords[i+1], sim_steps);
-        }
+    long particleSteps = 0;
+    if(opts.engine == ENGINE_BATCH) {
+        particleSteps = batchWalk(cilk_for_range(), workerSlot, &hist, coords, coordPairs, amount, sim_steps, cells, radius,
+                                  &frontier, [&](const BatchFrontier* f) { batchPass(cilk_for_range(), &run, f); });
+    } else if(opts.engine == ENGINE_PHILOX) {
+        walkRoots(cilk_for_range(), &run, [&](int lo, int hi) {
+            cilk_for(int p=lo;p<hi;p++) {
+                const int e = p / amount;
+                philoxTask(rootId(e, p % amount), coords[2*e], coords[2*e+1], sim_steps, 0);
+            }
+            return 0;
+        });
+    } else {
+        walkRoots(cilk_for_range(), &run, [&](int lo, int hi) {
+            int particles = 0;
+            for(int p=lo;p<hi;p++) {
+                // the particles of emitter e are seeded 2e+j
+                const int e = p / amount;
+                particles += walkerTask(2*e + p % amount, coords[2*e], coords[2*e+1], sim_steps, 0);
+            }
+            return particles;
+        });
+        totParticles = run.particles;
+    }
+    runEnd(&run);
+    histogramMerge(cilk_for_range(), &hist, outArea);
+    histogramFree(&hist);
+    const double elapsed = wallTime() - start;
+    if(opts.engine != ENGINE_BATCH) {
+        particleSteps = totalSteps(stepCounts, hist.slots);
+    }
+    unsigned int checksum;
+    const int recorded = histogramTotal(radius, outArea, &checksum);
+    if(opts.engine != ENGINE_DRAND48) {
+        totParticles = recorded;
     }
     printf("Walks complete... finished with %d particles\n",totParticles);
+    printf("Histogram holds %d particles, checksum %08x\n",recorded,checksum);
+    printf("%ld particle-steps in %.3f s, %.3g particle-steps/sec\n",particleSteps,elapsed,(particleSteps-resumed)/elapsed);
+    if(opts.engine != ENGINE_BATCH) {
+        spawnReport(&spawnPolicy);
+    }
    
     // Generate the output
-    writeOutput(radius, outArea);
+    writeOutput(cilk_for_range(), radius, outArea, opts.output);
 
     free(coords);
     free(outArea);
+    free(stepCounts);
+    spawnFree(&spawnPolicy);
     free(splitProb);
     free(area);
+    free(cells);
 }
@@ -1,5 +1,24 @@
 #ifndef STARHOLE_HELPERS
 #define STARHOLE_HELPERS
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// calloc() for per worker records padded to a cache line: zeroed and 64 byte aligned,
+// so no record shares a line with its neighbour; release with free()
+void* callocLines(size_t count, size_t size) {
+    void* mem = NULL;
+    if(posix_memalign(&mem, 64, count * size) != 0) {
+        return NULL;
+    }
+    memset(mem, 0, count * size);
+    return mem;
+}
+
+#include "starhole_philox.cpp"
+#include "starhole_histogram.cpp"
+
 // Represents the probability that a Carter particle will move to a nearby cell
 // The structure is read as r < prob[i]; prob[i] is a summation of the probabilities
 // of the cells checked earlier with the probability of the current cell
@@ -90,24 +109,371 @@ void updateLocation(struct drand48_data* seedbuf, DirUpdate* area, int* x, int *
     return;
 }
 
-// Helper to initialize needed data structures
-void initialize(int radius, int**oa, double** sp, DirUpdate** a) {
+/*
+ * Counter based particles (-e philox, -e batch)
+ *
+ * A particle is identified by a 64 bit id instead of a drand48 seed. Each
+ * step uses 64 random bits: the low 32 decide the split, the high 32 the
+ * direction. The step taken with s steps left reads half of the philox
+ * block (s/2, 0, id), so one block serves two steps. A child's id is drawn
+ * from its own block (s, 1, id), only when the particle splits. A child's
+ * walk therefore depends only on its id, and the walks can be run in any
+ * order on any number of threads with the same final positions.
+ */
+static const uint32_t PHILOX_KEY0 = 0x57a7401e;
+static const uint32_t PHILOX_KEY1 = 0xca7e7000;
+
+// Particle j of emitter e
+static inline uint64_t rootId(int e, int j) {
+    return ((uint64_t)e << 32) | (uint32_t)j;
+}
+
+// The last philox block a particle used
+typedef struct _stepBlock {
+    Philox4x32 bits;
+    int index;
+} StepBlock;
+
+static inline void stepBlockReset(StepBlock* b) {
+    b->index = -1;
+}
+
+// The 64 random bits of particle id's step with stepsremaining steps left
+static inline uint64_t stepBits(uint64_t id, int stepsremaining, StepBlock* b) {
+    const int index = stepsremaining >> 1;
+    if(index != b->index) {
+        b->bits = philox4x32_10((uint32_t)index, 0, (uint32_t)id, (uint32_t)(id >> 32), PHILOX_KEY0, PHILOX_KEY1);
+        b->index = index;
+    }
+    const uint32_t* v = b->bits.v + 2 * (stepsremaining & 1);
+    return ((uint64_t)v[1] << 32) | v[0];
+}
+
+// Id of the particle that splits from id on the step with stepsremaining steps left
+static inline uint64_t childId(uint64_t id, int stepsremaining) {
+    const Philox4x32 r = philox4x32_10((uint32_t)stepsremaining, 1, (uint32_t)id, (uint32_t)(id >> 32), PHILOX_KEY0, PHILOX_KEY1);
+    return ((uint64_t)r.v[1] << 32) | r.v[0];
+}
+
+// Cell offsets of the DirUpdate entries: ul u ur l - r ll d lr
+static const int dirX[9] = { -1, 0, 1, -1, 0, 1, -1, 0, 1 };
+static const int dirY[9] = { 1, 1, 1, 0, 0, 0, -1, -1, -1 };
+
+/*
+ * Walker alias table for the 9 directions of a cell, used by the counter
+ * based engines in place of the cumulative DirUpdate (28 bytes instead of 72).
+ *
+ * A 32 bit draw r picks column k = (9r) >> 32; the low bits of 9r are
+ * uniform within the column and are compared with its threshold: below it
+ * the particle moves in direction k, otherwise in direction alias[k]. That
+ * is one multiply, one load and one select per step, with no branches on
+ * the drawn value.
+ */
+typedef struct _dirAlias {
+    uint16_t threshold[9];  // out of 65536
+    uint8_t alias[9];
+    uint8_t pad;
+} DirAlias;
+
+// Builds the alias table for the probabilities packed in d (Vose's method)
+void buildDirAlias(const DirUpdate* d, DirAlias* a) {
+    double q[9];
+    double prev = 0.0;
+    for(int k=0;k<9;k++) {
+        // directions outside the radius are stored as 0 between the running sums
+        q[k] = d->prob[k] > 0.0 ? d->prob[k] - prev : 0.0;
+        if(d->prob[k] > 0.0) {
+            prev = d->prob[k];
+        }
+    }
+    if(!(prev > 0.0)) {
+        // a cell no particle can reach; move lower right like the cascade does
+        for(int k=0;k<9;k++) {
+            a->threshold[k] = 0;
+            a->alias[k] = 8;
+        }
+        a->pad = 0;
+        return;
+    }
+    int small[9], large[9], ns = 0, nl = 0;
+    for(int k=0;k<9;k++) {
+        q[k] = q[k] * 9.0 / prev;
+        if(q[k] < 1.0) {
+            small[ns++] = k;
+        } else {
+            large[nl++] = k;
+        }
+    }
+    double keep[9];
+    for(int k=0;k<9;k++) {
+        keep[k] = 1.0;
+        a->alias[k] = k;
+    }
+    while(ns > 0 && nl > 0) {
+        const int s = small[--ns];
+        const int l = large[--nl];
+        keep[s] = q[s];
+        a->alias[s] = l;
+        q[l] -= 1.0 - q[s];
+        if(q[l] < 1.0) {
+            small[ns++] = l;
+        } else {
+            large[nl++] = l;
+        }
+    }
+    for(int k=0;k<9;k++) {
+        const double t = floor(keep[k] * 65536.0 + 0.5);
+        a->threshold[k] = t >= 65535.0 ? 65535 : (uint16_t)t;
+    }
+    a->pad = 0;
+}
+
+// Direction (0-8, as in DirUpdate) for the 32 random bits r
+static inline int aliasDir(const DirAlias& a, uint32_t r) {
+    const uint64_t m = (uint64_t)r * 9;
+    const int k = (int)(m >> 32);
+    return ((uint32_t)m >> 16) < a.threshold[k] ? k : a.alias[k];
+}
+
+/*
+ * Everything a counter based step reads about a cell, in one 32 byte record
+ * (two to a cache line, never split across lines): the split probability
+ * as a threshold on 32 random bits, and the direction alias table.
+ */
+typedef struct _cellRecord {
+    uint32_t split;     // splits when the low 32 bits are below this
+    DirAlias dir;       // direction from the high 32 bits
+} CellRecord;
+
+void buildCellRecord(int x, int y, int radius, const DirUpdate* d, CellRecord* c) {
+    // u < p exactly when u*2^32 < ceil(p*2^32), for u = bits/2^32
+    const double t = ceil(computeSplitProb(x,y,radius) * 4294967296.0);
+    c->split = t >= 4294967295.0 ? 0xffffffffu : (uint32_t)t;
+    buildDirAlias(d,&(c->dir));
+}
+
+static inline int cellSplits(const CellRecord& c, uint64_t bits) {
+    return (uint32_t)bits < c.split;
+}
+
+static inline int cellDir(const CellRecord& c, uint64_t bits) {
+    return aliasDir(c.dir, (uint32_t)(bits >> 32));
+}
+
+static inline void cellMove(const CellRecord& c, uint64_t bits, int* x, int* y) {
+    const int k = cellDir(c, bits);
+    *x += dirX[k];
+    *y += dirY[k];
+}
+
+/*
+ * Field setup
+ *
+ * computeDirProb() weighs each of a cell's 9 neighbors by a function of the
+ * neighbor's distance from the origin only, so the weight of (x,y) is also
+ * the weight of (-x,y), (y,x) and the other cells of its 8-way symmetry.
+ * The weights (two exp calls each) are computed once for the octant
+ * 0 <= b <= a <= radius+1 and looked up for every neighbor of every cell:
+ * about 1/36 of the exp calls of computing each cell's neighbors in turn,
+ * and the same tables bit for bit, since the cumulative sums are still
+ * added up in DirUpdate order. Both the octant and the rows of cells are
+ * split over the program's parallel loop functor
+ *     pfor(begin, end, f)  calls f(b, e) on disjoint sub-ranges covering [begin, end)
+ */
+
+// Weight computeDirProb() gives to moving into (x,y), 0 outside the radius
+double cellWeight(int x, int y, int radius) {
+    const double d = dist(x,y);
+    if(d < radius) {
+        return 2*gaussianFunc(d,0,1,sqrt(radius)) + gaussianFunc(d,radius/2,1,sqrt(radius*4))+.01;
+    }
+    return 0.0;
+}
+
+// Index of the octant entry (a, b), a >= b >= 0, holding the weight of (x,y)
+static inline size_t octantIndex(int x, int y) {
+    x = abs(x);
+    y = abs(y);
+    const size_t a = x > y ? x : y;
+    const size_t b = x > y ? y : x;
+    return a*(a+1)/2 + b;
+}
+
+// cellWeight() for the octant of |x|,|y| <= radius+1; free() the result
+template<typename ParallelFor>
+double* octantWeights(const ParallelFor& pfor, int radius) {
+    const size_t n = radius + 2;
+    double* weights = (double*)malloc(sizeof(double)*n*(n+1)/2);
+    // split by entry rather than by a, since row a has a+1 entries
+    pfor(0, (int)(n*(n+1)/2), [=](int begin, int end) {
+        size_t a = (size_t)((sqrt(8.0*begin+1.0)-1.0)/2.0);
+        while(a*(a+1)/2 > (size_t)begin) a--;
+        while((a+1)*(a+2)/2 <= (size_t)begin) a++;
+        size_t b = begin - a*(a+1)/2;
+        for(int i=begin;i<end;i++) {
+            weights[i] = cellWeight((int)a,(int)b,radius);
+            if(++b > a) {
+                a++;
+                b = 0;
+            }
+        }
+    });
+    return weights;
+}
+
+// computeDirProb() with the neighbor weights looked up in the octant
+void dirProbFromWeights(int x, int y, const double* weights, DirUpdate* loc) {
+    double acc = 0.0;
+    for(int i=0;i<9;i++) {
+        const double w = weights[octantIndex(x+dirX[i], y+dirY[i])];
+        if(w > 0.0) {
+            acc+=w; loc->prob[i] = acc;
+        } else { loc->prob[i] = 0.0; }
+    }
+    for(int i=0;i<9;i++) {
+        loc->prob[i] = loc->prob[i]/acc;
+    }
+}
+
+/*
+ * Table cache (-c dir)
+ *
+ * The tables for a radius are saved to dir/starhole_<kind>_r<radius>.bin
+ * after they are computed, and later runs with the same radius read them
+ * back instead. The header guards against a file from another radius,
+ * layout or version of the weights; any mismatch just recomputes.
+ */
+static const uint32_t TABLE_MAGIC = 0x4c485453;     // "STHL"
+static const uint32_t TABLE_VERSION = 1;
+
+typedef struct _tableHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t radius;
+    uint32_t cellBytes;     // bytes per cell over all the arrays
+} TableHeader;
+
+void tablePath(char* path, size_t size, const char* dir, const char* kind, int radius) {
+    snprintf(path, size, "%s/starhole_%s_r%d.bin", dir, kind, radius);
+}
+
+// Fills the n arrays of bytes[i] bytes each from path; false if it holds other tables
+bool readTables(const char* path, int radius, int cellBytes, void** arrays, const size_t* bytes, int n) {
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        return false;
+    }
+    TableHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == TABLE_MAGIC && h.version == TABLE_VERSION
+              && h.radius == radius && h.cellBytes == (uint32_t)cellBytes;
+    for(int i=0;ok && i<n;i++) {
+        ok = fread(arrays[i], 1, bytes[i], f) == bytes[i];
+    }
+    fclose(f);
+    return ok;
+}
+
+// Saves the arrays to path, through a temporary file so readers never see half of one
+void writeTables(const char* path, int radius, int cellBytes, void* const* arrays, const size_t* bytes, int n) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if(f == NULL) {
+        printf("Could not write %s\n", tmp);
+        return;
+    }
+    const TableHeader h = { TABLE_MAGIC, TABLE_VERSION, radius, (uint32_t)cellBytes };
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for(int i=0;ok && i<n;i++) {
+        ok = fwrite(arrays[i], 1, bytes[i], f) == bytes[i];
+    }
+    ok = fclose(f) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0) {
+        printf("Could not write %s\n", path);
+        remove(tmp);
+    }
+}
+
+// Helper to initialize needed data structures; cacheDir may be NULL
+template<typename ParallelFor>
+void initialize(const ParallelFor& pfor, int radius, int**oa, double** sp, DirUpdate** a, const char* cacheDir) {
     int rows = 2*radius+1;
     int cols = 2*radius+1;
     
-    int* outArea = (*oa) = (int*)calloc(rows*cols,sizeof(int));
+    (*oa) = (int*)calloc(rows*cols,sizeof(int));
     double* splitProb = (*sp) = (double*)malloc(sizeof(double)*rows*cols);
     DirUpdate* area = (*a) = (DirUpdate*)malloc(sizeof(DirUpdate)*rows*cols);
+
+    char path[4096];
+    void* arrays[2] = { splitProb, area };
+    const size_t bytes[2] = { sizeof(double)*rows*cols, sizeof(DirUpdate)*rows*cols };
+    const int cellBytes = sizeof(double) + sizeof(DirUpdate);
+    if(cacheDir != NULL) {
+        tablePath(path, sizeof(path), cacheDir, "cascade", radius);
+        if(readTables(path, radius, cellBytes, arrays, bytes, 2)) {
+            printf("Read the tables from %s\n", path);
+            return;
+        }
+    }
+
+    double* weights = octantWeights(pfor, radius);
+    pfor(0, rows, [=](int begin, int end) {
+        for(int j=begin-radius;j<end-radius;j++) {
+            for(int i=-radius;i<radius+1;i++) {
+                int offset = toOffset(i,j,radius);
+                // pack split prob -- i,j
+                splitProb[offset] = computeSplitProb(i,j,radius);
+                // pack dir update -- i,j
+                dirProbFromWeights(i,j,weights,&(area[offset]));
+            }
+        }
+    });
+    free(weights);
+
+    if(cacheDir != NULL) {
+        writeTables(path, radius, cellBytes, arrays, bytes, 2);
+    }
+}
+
+// initialize() for the counter based engines: one CellRecord per cell
+template<typename ParallelFor>
+void initializeCells(const ParallelFor& pfor, int radius, int**oa, CellRecord** c, const char* cacheDir) {
+    int rows = 2*radius+1;
+    int cols = 2*radius+1;
     
-    for(int i=-radius;i<radius+1;i++) {
-        for(int j=-radius;j<radius+1;j++) {
-            int offset = toOffset(i,j,radius);
-            // pack split prob -- i,j
-            splitProb[offset] = computeSplitProb(i,j,radius);
-            // pack dir update -- i,j
-            computeDirProb(i,j,radius,&(area[offset]));
+    (*oa) = (int*)calloc(rows*cols,sizeof(int));
+    void* mem = NULL;
+    if(posix_memalign(&mem, 64, sizeof(CellRecord)*rows*cols) != 0) {
+        mem = NULL;
+    }
+    CellRecord* cells = (*c) = (CellRecord*)mem;
+
+    char path[4096];
+    void* arrays[1] = { cells };
+    const size_t bytes[1] = { sizeof(CellRecord)*rows*cols };
+    if(cacheDir != NULL) {
+        tablePath(path, sizeof(path), cacheDir, "cells", radius);
+        if(readTables(path, radius, sizeof(CellRecord), arrays, bytes, 1)) {
+            printf("Read the tables from %s\n", path);
+            return;
         }
     }
+
+    double* weights = octantWeights(pfor, radius);
+    pfor(0, rows, [=](int begin, int end) {
+        for(int j=begin-radius;j<end-radius;j++) {
+            for(int i=-radius;i<radius+1;i++) {
+                DirUpdate d;
+                dirProbFromWeights(i,j,weights,&d);
+                buildCellRecord(i,j,radius,&d,&(cells[toOffset(i,j,radius)]));
+            }
+        }
+    });
+    free(weights);
+
+    if(cacheDir != NULL) {
+        writeTables(path, radius, sizeof(CellRecord), arrays, bytes, 1);
+    }
 }
 
 int readArgs(int argc, char** argv, int* sim_steps, int* radius, int* amount, int* coordPairs, int** coords) {
@@ -151,42 +517,331 @@ int readArgs(int argc, char** argv, int* sim_steps, int* radius, int* amount, in
     return 0;
 }
 
-void writeOutput(int radius, int* outArea) {
-    // Generate the output
-    int rows = radius*2+1;
-    int cols = radius*2+1;
- 
-    // find the cell with the most
-    int max=0;
-    for(int i=0;i<rows*cols; i++) {
-        if(outArea[i]>max) {
-            max=outArea[i];
+// Default -s: children with fewer steps left are walked inline
+static const int SPAWN_STEPS = 64;
+
+// Walk engines selectable with -e
+enum WalkEngine { ENGINE_DRAND48, ENGINE_PHILOX, ENGINE_BATCH };
+
+typedef struct _simOptions {
+    WalkEngine engine;
+    HistogramMode histogram;
+    const char* cacheDir;   // -c, NULL when the tables are not cached
+    const char* checkpoint; // -C, NULL for no checkpoints
+    double checkpointEvery; // -i seconds
+    bool restart;           // -R
+    double progress;        // -P seconds between progress reports, 0 for none
+    const char* output;     // -o
+    int spawnSteps;         // -s
+    int spawnDepth;         // -d
+    double spawnAdapt;      // -A microseconds, 0 for a fixed cutoff
+} SimOptions;
+
+/*
+ * Reads the options in front of <steps>; option parsing stops at the first
+ * positional argument so negative coordinates are not taken for options.
+ * Returns the index of <steps> in argv, or -1 on a bad option.
+ */
+int readOptions(int argc, char** argv, SimOptions* opts) {
+    opts->engine = ENGINE_DRAND48;
+    opts->histogram = HIST_AUTO;
+    opts->cacheDir = NULL;
+    opts->checkpoint = NULL;
+    opts->checkpointEvery = 600.0;
+    opts->restart = false;
+    opts->progress = 0.0;
+    opts->output = "out.jpg";
+    opts->spawnSteps = SPAWN_STEPS;
+    opts->spawnDepth = 0;
+    opts->spawnAdapt = 0.0;
+    int opt;
+    while((opt = getopt(argc, argv, "+e:H:c:C:i:RP:o:s:d:A:")) != -1) {
+        switch(opt) {
+            case 'e':
+                if(strcmp(optarg, "drand48") == 0) {
+                    opts->engine = ENGINE_DRAND48;
+                } else if(strcmp(optarg, "philox") == 0) {
+                    opts->engine = ENGINE_PHILOX;
+                } else if(strcmp(optarg, "batch") == 0) {
+                    opts->engine = ENGINE_BATCH;
+                } else {
+                    printf("Unknown engine %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'H':
+                if(strcmp(optarg, "auto") == 0) {
+                    opts->histogram = HIST_AUTO;
+                } else if(strcmp(optarg, "dense") == 0) {
+                    opts->histogram = HIST_DENSE;
+                } else if(strcmp(optarg, "sparse") == 0) {
+                    opts->histogram = HIST_SPARSE;
+                } else {
+                    printf("Unknown histogram %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'c':
+                opts->cacheDir = optarg;
+                break;
+            case 'C':
+                opts->checkpoint = optarg;
+                break;
+            case 'i':
+                opts->checkpointEvery = atof(optarg);
+                break;
+            case 'R':
+                opts->restart = true;
+                break;
+            case 'P':
+                opts->progress = atof(optarg);
+                break;
+            case 'o':
+                opts->output = optarg;
+                break;
+            case 's':
+                opts->spawnSteps = atoi(optarg);
+                break;
+            case 'd':
+                opts->spawnDepth = atoi(optarg);
+                break;
+            case 'A':
+                opts->spawnAdapt = atof(optarg);
+                break;
+            default:
+                return -1;
         }
     }
-    // Generate the output image
-    printf("Mat out(%d, %d, %d)\n",radius*2+1, radius*2+1,CV_8UC3);
-    Mat out(rows, cols, CV_8UC3);
-    for(int i=0;i<radius*2+1;i++) {
-        for(int j=0;j<radius*2+1;j++) {
-            const size_t offset = i + (j*(radius*2+1));
-            // paint the ring
-            double ring=0.0;
-            if(dist(i-radius,j-radius)<=radius) {
-               ring = 1.0;
+    if(opts->restart && opts->checkpoint == NULL) {
+        printf("-R needs the checkpoint file given with -C\n");
+        return -1;
+    }
+    return optind;
+}
+
+void printUsage(const char* name) {
+    printf("Usage: %s [-e drand48|philox|batch] [-H auto|dense|sparse] [-c dir] [-C file [-i sec] [-R]] [-P sec] [-o file] [-s steps] [-d depth] [-A usec] <steps> <radius> <amount> <x1> <y1> ... <xN> <yN>\n", name);
+    printf("  -e philox  counter based random numbers: every particle is an independent task\n");
+    printf("             and the output does not depend on the thread count or backend\n");
+    printf("  -e batch   the philox particles stepped together in arrays instead of recursively\n");
+    printf("  -H         per worker counts: full arrays (dense), logs of the hit cells (sparse),\n");
+    printf("             or dense while they fit in %d MB (auto)\n", (int)(HIST_DENSE_BUDGET >> 20));
+    printf("  -c dir     keep the lookup tables for the radius in dir and read them from there\n");
+    printf("             on later runs instead of computing them\n");
+    printf("  -C file    checkpoint the counts and the particles left to walk to file every -i\n");
+    printf("             seconds (default 600); -R resumes the run from the file\n");
+    printf("  -P sec     report particle-steps/sec and the time left every sec seconds\n");
+    printf("  -o file    output (default out.jpg): .raw the counts as ints, .pgm the counts as a\n");
+    printf("             grey image, .ppm the picture uncompressed, else the picture via OpenCV\n");
+    printf("  -s steps   Cilk, OpenMP and TBB: a particle that splits off gets a task of its own\n");
+    printf("             only with more than steps steps left (default %d) or when -d depth\n", SPAWN_STEPS);
+    printf("             is given and its parent is fewer than depth spawns from its root;\n");
+    printf("             otherwise it is walked inline. -A usec adapts steps to tasks of usec\n");
+    printf("             microseconds from the measured walking rate\n");
+}
+
+// Particle-steps walked by one worker, alone in its cache line
+typedef struct _stepCount {
+    long steps;
+    char pad[64 - sizeof(long)];
+} StepCount;
+
+long totalSteps(StepCount* counts, int slots) {
+    long total = 0;
+    for(int i=0;i<slots;i++) {
+        total += counts[i].steps;
+    }
+    return total;
+}
+
+double wallTime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Total of the histogram and an FNV-1a hash of it, for comparing runs
+int histogramTotal(int radius, int* outArea, unsigned int* checksum) {
+    const int cells = (radius*2+1)*(radius*2+1);
+    int total = 0;
+    unsigned int h = 2166136261u;
+    for(int i=0;i<cells;i++) {
+        total += outArea[i];
+        h = (h ^ (unsigned int)outArea[i]) * 16777619u;
+    }
+    *checksum = h;
+    return total;
+}
+
+/*
+ * Output (-o file); the extension picks the format:
+ *     .raw   the counts as native ints in outArea order, (2r+1)^2 of them
+ *     .pgm   the counts as a grey image, 8 bit when they fit and 16 bit
+ *            otherwise, clipped at 65535
+ *     .ppm   the picture out.jpg shows, uncompressed
+ *     other  the picture through imwrite (out.jpg by default)
+ * Image row i is x = i-radius and column j is y = j-radius, so outArea is
+ * column major in the image. The rows are split over the program's parallel
+ * loop functor in tiles of RENDER_TILE rows, which read outArea in runs of
+ * RENDER_TILE ints while each row is written left to right.
+ */
+static const int RENDER_TILE = 16;
+// counts up to this have their grey level in a table
+static const int RENDER_LUT = 1 << 16;
+
+// Largest count, with a share of the cells per task
+template<typename ParallelFor>
+int maxCount(const ParallelFor& pfor, int cells, const int* outArea) {
+    const int parts = 64;
+    std::vector<int> partMax(parts, 0);
+    int* pm = &partMax[0];
+    pfor(0, parts, [=](int begin, int end) {
+        for(int t=begin;t<end;t++) {
+            int max = 0;
+            const int hi = (int)((long)cells * (t+1) / parts);
+            for(int i=(int)((long)cells * t / parts);i<hi;i++) {
+                max = outArea[i] > max ? outArea[i] : max;
+            }
+            pm[t] = max;
+        }
+    });
+    int max = 0;
+    for(int t=0;t<parts;t++) {
+        max = partMax[t] > max ? partMax[t] : max;
+    }
+    return max;
+}
+
+// Calls px(i, j, count) for every pixel, a tile of rows per task
+template<typename ParallelFor, typename Pixel>
+void renderTiles(const ParallelFor& pfor, int radius, const int* outArea, const Pixel& px) {
+    const int rows = 2*radius+1;
+    pfor(0, (rows + RENDER_TILE - 1) / RENDER_TILE, [&](int begin, int end) {
+        for(int t=begin;t<end;t++) {
+            const int i0 = t * RENDER_TILE;
+            const int i1 = i0 + RENDER_TILE < rows ? i0 + RENDER_TILE : rows;
+            for(int j=0;j<rows;j++) {
+                const int* column = outArea + (size_t)j*rows;
+                for(int i=i0;i<i1;i++) {
+                    px(i, j, column[i]);
+                }
             }
-            double intensity = sqrt((double)outArea[offset]/(double)max);
+        }
+    });
+}
+
+// The picture: grey sqrt(count/max) where particles ended, the ring in dark blue
+template<typename ParallelFor>
+void renderImage(const ParallelFor& pfor, int radius, const int* outArea, Mat& out) {
+    const int rows = radius*2+1;
+    const int max = maxCount(pfor, rows*rows, outArea);
 
-            if(intensity>0) {
-            out.at<Vec3b>(i, j) = Vec3b(floor(intensity * 255.0),
-                                        floor(intensity * 255.0),
-                                        floor(intensity * 255.0));
+    // ring[i]: the pixels of row i within the radius are |j-radius| <= ring[i]
+    std::vector<int> ring(rows);
+    for(int i=0;i<rows;i++) {
+        const long left = (long)radius*radius - (long)(i-radius)*(i-radius);
+        int h = (int)sqrt((double)left);
+        while((long)h*h > left) h--;
+        while((long)(h+1)*(h+1) <= left) h++;
+        ring[i] = h;
+    }
+    // grey level of each count, as floor(sqrt(count/max) * 255.0)
+    std::vector<uchar> grey(max < RENDER_LUT ? max+1 : 0);
+    for(size_t c=1;c<grey.size();c++) {
+        grey[c] = (uchar)floor(sqrt((double)c/(double)max) * 255.0);
+    }
+
+    out.create(rows, rows, CV_8UC3);
+    const uchar* lut = grey.empty() ? NULL : &grey[0];
+    const int* ringHalf = &ring[0];
+    renderTiles(pfor, radius, outArea, [&](int i, int j, int count) {
+        Vec3b& p = out.at<Vec3b>(i, j);
+        if(count > 0) {
+            const uchar g = lut != NULL ? lut[count] : (uchar)floor(sqrt((double)count/(double)max) * 255.0);
+            p = Vec3b(g, g, g);
+        } else {
+            p = Vec3b(0, 0, abs(j-radius) <= ringHalf[i] ? 128 : 0);
+        }
+    });
+}
+
+static bool hasExtension(const char* path, const char* ext) {
+    const size_t n = strlen(path), e = strlen(ext);
+    return n >= e && strcmp(path + n - e, ext) == 0;
+}
+
+template<typename ParallelFor>
+void writeOutput(const ParallelFor& pfor, int radius, int* outArea, const char* path) {
+    const int rows = radius*2+1;
+    const size_t cells = (size_t)rows*rows;
+    if(hasExtension(path, ".raw")) {
+        FILE* f = fopen(path, "wb");
+        if(f == NULL || fwrite(outArea, sizeof(int), cells, f) != cells) {
+            printf("Could not write %s\n", path);
+        }
+        if(f != NULL) {
+            fclose(f);
+        }
+        return;
+    }
+    if(hasExtension(path, ".pgm")) {
+        const int max = maxCount(pfor, (int)cells, outArea);
+        const int maxval = max < 1 ? 1 : (max > 65535 ? 65535 : max);
+        const int bytes = maxval < 256 ? 1 : 2;
+        std::vector<uchar> img(cells * bytes);
+        uchar* data = &img[0];
+        renderTiles(pfor, radius, outArea, [=](int i, int j, int count) {
+            const int v = count > 65535 ? 65535 : count;
+            uchar* p = data + ((size_t)i*rows + j) * bytes;
+            if(bytes == 1) {
+                p[0] = (uchar)v;
             } else {
-            out.at<Vec3b>(i, j) = Vec3b(floor(0 * 255.0),
-                                        floor(0 * 255.0),
-                                        floor(ring * 128.0));
+                // 16 bit PGM samples are big endian
+                p[0] = (uchar)(v >> 8);
+                p[1] = (uchar)v;
             }
+        });
+        FILE* f = fopen(path, "wb");
+        if(f == NULL || fprintf(f, "P5\n%d %d\n%d\n", rows, rows, maxval) < 0
+           || fwrite(data, 1, img.size(), f) != img.size()) {
+            printf("Could not write %s\n", path);
         }
+        if(f != NULL) {
+            fclose(f);
+        }
+        return;
     }
-    imwrite("out.jpg", out);
+
+    // Generate the output image
+    printf("Mat out(%d, %d, %d)\n",radius*2+1, radius*2+1,CV_8UC3);
+    Mat out;
+    renderImage(pfor, radius, outArea, out);
+    if(hasExtension(path, ".ppm")) {
+        // PPM rows are RGB, the Mat's BGR
+        std::vector<uchar> row((size_t)rows * 3);
+        FILE* f = fopen(path, "wb");
+        bool ok = f != NULL && fprintf(f, "P6\n%d %d\n255\n", rows, rows) > 0;
+        for(int i=0;ok && i<rows;i++) {
+            const uchar* p = out.ptr(i);
+            for(int j=0;j<rows;j++) {
+                row[3*j] = p[3*j+2];
+                row[3*j+1] = p[3*j+1];
+                row[3*j+2] = p[3*j];
+            }
+            ok = fwrite(&row[0], 1, row.size(), f) == row.size();
+        }
+        if(!ok) {
+            printf("Could not write %s\n", path);
+        }
+        if(f != NULL) {
+            fclose(f);
+        }
+        return;
+    }
+    imwrite(path, out);
 }
+
+#include "starhole_batch.cpp"
+#include "starhole_checkpoint.cpp"
+#include "starhole_spawn.cpp"
 #endif
@@ -0,0 +1,126 @@
+#ifndef STARHOLE_HISTOGRAM
+#define STARHOLE_HISTOGRAM
+/*
+ * Final location counts kept per worker so walkers never write to a shared
+ * cell, then merged into outArea once the walks are done.
+ *
+ *     HIST_DENSE   one full (2r+1)^2 count array per worker; the merge sums
+ *                  the arrays over disjoint ranges of cells
+ *     HIST_SPARSE  each worker appends the offsets it records to a log per
+ *                  shard (a contiguous range of cells); the merge replays the
+ *                  logs one shard per task, so memory follows the number of
+ *                  particles instead of the field size
+ *     HIST_AUTO    dense while all the arrays fit in HIST_DENSE_BUDGET bytes
+ *
+ * Each worker's logs sit in cache lines of their own (callocLines(), from
+ * starhole_common.cpp), so appending to them never touches a line another
+ * worker writes.
+ *
+ * Workers are numbered 0..slots-1 by the program (its thread or worker
+ * number), and the merge runs on the program's parallel loop functor
+ *     pfor(begin, end, f)  calls f(b, e) on disjoint sub-ranges covering [begin, end)
+ * Counts are exact and no atomics are used.
+ */
+#include <stdlib.h>
+#include <new>
+#include <vector>
+
+enum HistogramMode { HIST_AUTO, HIST_DENSE, HIST_SPARSE };
+
+static const size_t HIST_DENSE_BUDGET = 64u << 20;
+// cells per sparse shard, as a shift
+static const int HIST_SHARD_SHIFT = 14;
+
+typedef struct _histogram {
+    int radius;
+    int cells;
+    int slots;
+    HistogramMode mode;
+    int* dense;                    // dense[slot*cells + offset]
+    int shards;
+    std::vector<int>** logs;       // logs[slot][shard] holds offsets
+} Histogram;
+
+const char* histogramModeName(HistogramMode mode) {
+    switch(mode) {
+        case HIST_DENSE: return "dense";
+        case HIST_SPARSE: return "sparse";
+        default: return "auto";
+    }
+}
+
+void histogramInit(Histogram* h, int radius, int slots, HistogramMode mode) {
+    h->radius = radius;
+    h->cells = (2*radius+1)*(2*radius+1);
+    h->slots = slots;
+    if(mode == HIST_AUTO) {
+        mode = (size_t)slots * h->cells * sizeof(int) <= HIST_DENSE_BUDGET ? HIST_DENSE : HIST_SPARSE;
+    }
+    h->mode = mode;
+    h->dense = NULL;
+    h->logs = NULL;
+    h->shards = ((h->cells - 1) >> HIST_SHARD_SHIFT) + 1;
+    if(mode == HIST_DENSE) {
+        h->dense = (int*)calloc((size_t)slots * h->cells, sizeof(int));
+    } else {
+        const size_t lines = ((size_t)h->shards * sizeof(std::vector<int>) + 63) / 64;
+        h->logs = new std::vector<int>*[slots];
+        for(int s=0;s<slots;s++) {
+            h->logs[s] = (std::vector<int>*)callocLines(lines, 64);
+            for(int shard=0;shard<h->shards;shard++) {
+                new (&h->logs[s][shard]) std::vector<int>();
+            }
+        }
+    }
+}
+
+void histogramFree(Histogram* h) {
+    free(h->dense);
+    for(int s=0;h->logs!=NULL && s<h->slots;s++) {
+        for(int shard=0;shard<h->shards;shard++) {
+            h->logs[s][shard].~vector();
+        }
+        free(h->logs[s]);
+    }
+    delete[] h->logs;
+    h->dense = NULL;
+    h->logs = NULL;
+}
+
+// Records a final location; slot must be the calling worker's own
+static inline void histogramAdd(Histogram* h, int slot, int offset) {
+    if(h->mode == HIST_DENSE) {
+        h->dense[(size_t)slot * h->cells + offset] += 1;
+    } else {
+        h->logs[slot][offset >> HIST_SHARD_SHIFT].push_back(offset);
+    }
+}
+
+// outArea += every worker's counts, then the workers' counts are cleared
+template<typename ParallelFor>
+void histogramMerge(const ParallelFor& pfor, Histogram* h, int* outArea) {
+    if(h->mode == HIST_DENSE) {
+        pfor(0, h->cells, [=](int b, int e) {
+            for(int s=0;s<h->slots;s++) {
+                int* counts = h->dense + (size_t)s * h->cells;
+                for(int i=b;i<e;i++) {
+                    outArea[i] += counts[i];
+                    counts[i] = 0;
+                }
+            }
+        });
+        return;
+    }
+    pfor(0, h->shards, [=](int b, int e) {
+        for(int shard=b;shard<e;shard++) {
+            for(int s=0;s<h->slots;s++) {
+                std::vector<int>& log = h->logs[s][shard];
+                for(size_t i=0;i<log.size();i++) {
+                    outArea[log[i]] += 1;
+                }
+                std::vector<int>().swap(log);
+            }
+        }
+    });
+}
+#endif
@@ -0,0 +1,322 @@
+/*
+ * starhole across MPI ranks (lab12 has the MPI basics)
+ *
+ * The unit of work is a root particle p in [0, coordPairs*amount): particle
+ * p % amount of emitter p / amount, with the seed or id the other programs
+ * give it. Rank 0 hands out chunks of roots on request, guided: a chunk is a
+ * share of what is left, so the chunks shrink towards the end and a rank
+ * stuck with long walks is not waited on for long. Rank 0 walks chunks of
+ * its own too and answers the requests between particles.
+ *
+ * Each rank walks its particles serially into its own histogram, and the
+ * histograms are summed on rank 0 with MPI_Reduce. A root's walk depends
+ * only on its seed (-e drand48) or id (-e philox), so the output is the same
+ * for any number of ranks and any distribution of the chunks.
+ *
+ *     mpirun -np 4 ./starhole_mpi [-e drand48|philox] [-H ...] [-c dir] <steps> <radius> <amount> <x1> <y1> ...
+ */
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstdint>
+#include <stdlib.h>
+#include <stdio.h>
+#include <mpi.h>
+#include <opencv2/opencv.hpp>
+
+using namespace cv;
+
+#include "starhole_common.cpp"
+
+// Histogram hooks: every rank walks serially
+struct serial_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        f(begin, end);
+    }
+};
+
+static inline int workerSlot() {
+    return 0;
+}
+
+// Message tags between rank 0 and the others
+static const int TAG_REQUEST = 1;   // a rank asks for work
+static const int TAG_CHUNK = 2;     // [begin, end) of roots, empty when all are handed out
+
+// Represents the area in which the particles move
+static DirUpdate*   area;
+
+// Split thresholds and direction tables together, for the counter based engines
+static CellRecord*  cells;
+
+// Holds the split probabilities for Carter particles in cells
+static double*      splitProb;
+
+// Holds final counts of particles in cells
+static int* outArea;
+
+// This rank's counts, merged into outArea after the walks
+static Histogram hist;
+
+// Particle-steps walked by this rank
+static StepCount* stepCounts;
+
+// Configuration parameters
+static int radius;
+static int sim_steps;
+static int* coords;
+static int amount;
+static WalkEngine engine;
+
+// Returns the total number of particles descending from this call
+// and increments the count at the right location
+int walker(long int seed, int x, int y, int stepsremaining) {
+    stepCounts[workerSlot()].steps += stepsremaining;
+    struct drand48_data seedbuf;
+    srand48_r(seed, &seedbuf);
+    int particles = 1;
+    for( ; stepsremaining>0 ; stepsremaining-- ) {
+
+        // Does the Carter particle split? If so, start the walk for the new one
+        if(doesSplit(&seedbuf, splitProb, x, y, radius)) {
+            long int newseed;
+            lrand48_r(&seedbuf, &newseed);
+            particles += walker(seed + newseed, x, y, stepsremaining-1);
+        }
+
+        // Make the particle walk?
+        updateLocation(&seedbuf, area, &x, &y, radius);
+    }
+
+    // record the final location
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
+
+    return particles;
+}
+
+// Walks particle id and every particle that splits from it, recording
+// their final locations
+void philoxWalker(uint64_t id, int x, int y, int stepsremaining) {
+    stepCounts[workerSlot()].steps += stepsremaining;
+    StepBlock block;
+    stepBlockReset(&block);
+    for( ; stepsremaining>0 ; stepsremaining-- ) {
+        const uint64_t bits = stepBits(id, stepsremaining, &block);
+        const CellRecord& c = cells[toOffset(x,y,radius)];
+        if(cellSplits(c, bits)) {
+            philoxWalker(childId(id, stepsremaining), x, y, stepsremaining-1);
+        }
+        cellMove(c, bits, &x, &y);
+    }
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
+}
+
+// Walks root particle p, returning the particles it produced for -e drand48
+static int walkRoot(int p) {
+    const int e = p / amount;
+    const int j = p % amount;
+    if(engine == ENGINE_PHILOX) {
+        philoxWalker(rootId(e,j), coords[2*e], coords[2*e+1], sim_steps);
+        return 0;
+    }
+    // the seeds of the serial program's emitter loop
+    return walker(2*e+j, coords[2*e], coords[2*e+1], sim_steps);
+}
+
+// Rank 0's share of the roots: the next chunk, empty once all are handed out
+typedef struct _chunker {
+    int next;
+    int roots;
+    int ranks;
+} Chunker;
+
+static void nextChunk(Chunker* c, int chunk[2]) {
+    const int left = c->roots - c->next;
+    int size = left / (2 * c->ranks);
+    if(size < 1) {
+        size = left < 1 ? 0 : 1;
+    }
+    chunk[0] = c->next;
+    chunk[1] = c->next + size;
+    c->next += size;
+}
+
+// Answers the requests that have arrived, or waits for one when block is set
+static void serveRequests(Chunker* c, MPI_Request* req, int* working, bool block) {
+    while(*working > 0) {
+        int flag = 1;
+        MPI_Status status;
+        if(block) {
+            MPI_Wait(req, &status);
+        } else {
+            MPI_Test(req, &flag, &status);
+        }
+        if(!flag) {
+            return;
+        }
+        int chunk[2];
+        nextChunk(c, chunk);
+        MPI_Send(chunk, 2, MPI_INT, status.MPI_SOURCE, TAG_CHUNK, MPI_COMM_WORLD);
+        if(chunk[0] == chunk[1]) {
+            *working -= 1;
+        }
+        if(*working > 0) {
+            MPI_Irecv(NULL, 0, MPI_INT, MPI_ANY_SOURCE, TAG_REQUEST, MPI_COMM_WORLD, req);
+        }
+        block = false;
+    }
+}
+
+// Rank 0: walks chunks and hands them out until none are left
+static int masterWalk(int roots, int ranks, int* rootsWalked) {
+    Chunker c = { 0, roots, ranks };
+    int working = ranks - 1;
+    MPI_Request req = MPI_REQUEST_NULL;
+    if(working > 0) {
+        MPI_Irecv(NULL, 0, MPI_INT, MPI_ANY_SOURCE, TAG_REQUEST, MPI_COMM_WORLD, &req);
+    }
+    int particles = 0;
+    for(;;) {
+        int chunk[2];
+        nextChunk(&c, chunk);
+        if(chunk[0] == chunk[1]) {
+            break;
+        }
+        for(int p=chunk[0];p<chunk[1];p++) {
+            particles += walkRoot(p);
+            serveRequests(&c, &req, &working, false);
+        }
+        *rootsWalked += chunk[1] - chunk[0];
+    }
+    // the others only need to hear that nothing is left
+    while(working > 0) {
+        serveRequests(&c, &req, &working, true);
+    }
+    return particles;
+}
+
+// Other ranks: ask rank 0 for chunks until it has none left
+static int workerWalk(int* rootsWalked) {
+    int particles = 0;
+    for(;;) {
+        int chunk[2];
+        MPI_Send(NULL, 0, MPI_INT, 0, TAG_REQUEST, MPI_COMM_WORLD);
+        MPI_Recv(chunk, 2, MPI_INT, 0, TAG_CHUNK, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if(chunk[0] == chunk[1]) {
+            return particles;
+        }
+        for(int p=chunk[0];p<chunk[1];p++) {
+            particles += walkRoot(p);
+        }
+        *rootsWalked += chunk[1] - chunk[0];
+    }
+}
+
+int main(int argc, char** argv) {
+    MPI_Init(&argc, &argv);
+    int rank, ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+    const char* name = argv[0];
+    SimOptions opts;
+    const int first = readOptions(argc, argv, &opts);
+    // readArgs and the count check expect <steps> at argv[1]
+    if(first > 0) {
+        argc -= first - 1;
+        argv += first - 1;
+    }
+    if(first < 0 || argc<6 || ((argc-4)%2 != 0) || opts.engine == ENGINE_BATCH
+       || opts.checkpoint != NULL || opts.progress > 0) {
+        if(rank == 0) {
+            printUsage(name);
+            printf("%s runs -e drand48 and -e philox (-e batch gives the -e philox histogram)\n", name);
+            printf("and takes no -C, -R or -P\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    engine = opts.engine;
+
+    if(rank == 0) {
+        printf("Attempting to setup initial state...\n");
+    }
+    // Initialize simulation Params
+    int coordPairs;
+    if(readArgs(argc, argv, &sim_steps, &radius, &amount, &coordPairs, &coords) != 0) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Initialize simulation lookups; with -c rank 0 fills the cache and the others read it
+    for(int pass=0;pass<2;pass++) {
+        if((rank == 0) == (pass == 0)) {
+            if(engine == ENGINE_DRAND48) {
+                initialize(serial_for(),radius,&outArea,&splitProb,&area,opts.cacheDir);
+            } else {
+                initializeCells(serial_for(),radius,&outArea,&cells,opts.cacheDir);
+            }
+        }
+        if(opts.cacheDir != NULL && pass == 0) {
+            MPI_Barrier(MPI_COMM_WORLD);
+        }
+    }
+    histogramInit(&hist, radius, 1, opts.histogram);
+    stepCounts = (StepCount*)callocLines(1, sizeof(StepCount));
+    if(rank == 0) {
+        printf("Counting in %s histograms on %d ranks\n", histogramModeName(hist.mode), ranks);
+        printf("Starting the walks...\n");
+    }
+
+    // Walk the roots handed to this rank
+    MPI_Barrier(MPI_COMM_WORLD);
+    const double start = wallTime();
+    int rootsWalked = 0;
+    int particles = rank == 0 ? masterWalk(coordPairs*amount, ranks, &rootsWalked) : workerWalk(&rootsWalked);
+    histogramMerge(serial_for(), &hist, outArea);
+    histogramFree(&hist);
+    const double walked = wallTime() - start;
+
+    // Sum the ranks' histograms and counts on rank 0
+    const int fieldCells = (2*radius+1)*(2*radius+1);
+    int* total = rank == 0 ? (int*)calloc(fieldCells, sizeof(int)) : NULL;
+    MPI_Reduce(outArea, total, fieldCells, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    int totParticles = 0;
+    MPI_Reduce(&particles, &totParticles, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    long particleSteps = 0;
+    MPI_Reduce(&stepCounts[0].steps, &particleSteps, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    const double elapsed = wallTime() - start;
+
+    // Per rank share of the work, to see how well the chunks balanced
+    double report[3] = { (double)rootsWalked, (double)stepCounts[0].steps, walked };
+    double* reports = rank == 0 ? (double*)malloc(sizeof(double)*3*ranks) : NULL;
+    MPI_Gather(report, 3, MPI_DOUBLE, reports, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    if(rank == 0) {
+        for(int r=0;r<ranks;r++) {
+            printf("rank %3d: %8d roots %13.0f particle-steps in %.3f s\n",
+                   r, (int)reports[3*r], reports[3*r+1], reports[3*r+2]);
+        }
+        unsigned int checksum;
+        const int recorded = histogramTotal(radius, total, &checksum);
+        if(engine != ENGINE_DRAND48) {
+            totParticles = recorded;
+        }
+        printf("Walks complete... finished with %d particles\n",totParticles);
+        printf("Histogram holds %d particles, checksum %08x\n",recorded,checksum);
+        printf("%ld particle-steps in %.3f s, %.3g particle-steps/sec\n",particleSteps,elapsed,particleSteps/elapsed);
+
+        // Generate the output
+        writeOutput(serial_for(), radius, total, opts.output);
+    }
+
+    free(reports);
+    free(total);
+    free(coords);
+    free(outArea);
+    free(stepCounts);
+    free(splitProb);
+    free(area);
+    free(cells);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef STARHOLE_PHILOX
+#define STARHOLE_PHILOX
+/*
+ * Philox4x32-10 counter based random numbers (Salmon, Moraes, Dror and Shaw,
+ * "Parallel Random Numbers: As Easy as 1, 2, 3", SC11).
+ *
+ * Unlike drand48_r there is no state to carry from one draw to the next:
+ * the 128 random bits for a counter are a pure function of (counter, key).
+ * A particle's draw for a given step is keyed by the particle's id and the
+ * step, so it can be computed by whichever thread happens to run the particle.
+ */
+#include <stdint.h>
+
+typedef struct _philox4x32 {
+    uint32_t v[4];
+} Philox4x32;
+
+// Returns the 128 random bits for counter c0..c3 under key k0,k1
+static inline Philox4x32 philox4x32_10(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t k0, uint32_t k1) {
+    for(int round = 0; round < 10; round++) {
+        const uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+        const uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+        const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    Philox4x32 r = { { c0, c1, c2, c3 } };
+    return r;
+}
+
+// Maps 32 random bits to a double in [0, 1)
+static inline double philoxUniform(uint32_t r) {
+    return r * (1.0 / 4294967296.0);
+}
+#endif
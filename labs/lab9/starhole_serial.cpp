@@ -9,15 +9,39 @@ using namespace cv;
 
 #include "starhole_common.cpp"
 
+// Histogram hooks: the loop runs in order and everything is worker 0
+struct serial_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        f(begin, end);
+    }
+};
+
+static inline int workerSlot() {
+    return 0;
+}
+
+static int workerSlots() {
+    return 1;
+}
+
 // Represents the area in which the particles move
 static DirUpdate*   area;
 
+// Split thresholds and direction tables together, for the counter based engines
+static CellRecord*  cells;
+
 // Holds the split probabilities for Carter particles in cells
 static double*      splitProb;
 
 // Holds final counts of particles in cells
 static int* outArea;
 
+// Per worker counts, merged into outArea after the walks
+static Histogram hist;
+
+// Particle-steps walked per worker
+static StepCount* stepCounts;
+
 // Configuration parameters
 static int radius;
 static int sim_steps;
@@ -25,6 +49,7 @@ static int sim_steps;
 // Returns the total number of particles descending from this call
 // and increments the count at the right location
 int walker(long int seed, int x, int y, int stepsremaining) {
+    stepCounts[workerSlot()].steps += stepsremaining;
     struct drand48_data seedbuf;
     srand48_r(seed, &seedbuf);
     int particles = 1;
@@ -43,14 +68,39 @@ int walker(long int seed, int x, int y, int stepsremaining) {
     }
     
     // record the final location
-    outArea[toOffset(x,y,radius)] += 1;
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
     
     return particles;
 }
 
+// Walks particle id and every particle that splits from it, recording
+// their final locations
+void philoxWalker(uint64_t id, int x, int y, int stepsremaining) {
+    stepCounts[workerSlot()].steps += stepsremaining;
+    StepBlock block;
+    stepBlockReset(&block);
+    for( ; stepsremaining>0 ; stepsremaining-- ) {
+        const uint64_t bits = stepBits(id, stepsremaining, &block);
+        const CellRecord& c = cells[toOffset(x,y,radius)];
+        if(cellSplits(c, bits)) {
+            philoxWalker(childId(id, stepsremaining), x, y, stepsremaining-1);
+        }
+        cellMove(c, bits, &x, &y);
+    }
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
+}
+
 int main(int argc, char** argv) {
-    if(argc<6 || ((argc-4)%2 != 0)) {
-        printf("Usage: %s <steps> <radius> <amount> <x1> <y1> ... <xN> <yN>\n",argv[0]);
+    const char* name = argv[0];
+    SimOptions opts;
+    const int first = readOptions(argc, argv, &opts);
+    // readArgs and the count check expect <steps> at argv[1]
+    if(first > 0) {
+        argc -= first - 1;
+        argv += first - 1;
+    }
+    if(first < 0 || argc<6 || ((argc-4)%2 != 0)) {
+        printUsage(name);
         return 1;
     }
 
@@ -61,24 +111,75 @@ int main(int argc, char** argv) {
     readArgs(argc, argv, &sim_steps, &radius, &amount, &coordPairs, &coords);
     
     // Initialize simulation lookups
-    initialize(radius,&outArea,&splitProb,&area);
+    if(opts.engine == ENGINE_DRAND48) {
+        initialize(serial_for(),radius,&outArea,&splitProb,&area,opts.cacheDir);
+    } else {
+        initializeCells(serial_for(),radius,&outArea,&cells,opts.cacheDir);
+    }
+    histogramInit(&hist, radius, workerSlots(), opts.histogram);
+    printf("Counting in %s histograms for %d workers\n", histogramModeName(hist.mode), hist.slots);
+    stepCounts = (StepCount*)callocLines(hist.slots, sizeof(StepCount));
     
     
     // Start initial walks
     printf("Starting the walks...\n");
+    RunControl run;
+    BatchFrontier frontier;
+    if(!runBegin(&run, &opts, opts.engine, radius, sim_steps, amount, coordPairs, coords, outArea, &hist, stepCounts,
+                 &frontier.particleSteps, &frontier.live, &frontier.n)) {
+        return 1;
+    }
+    frontier.nextRoot = run.nextRoot;
+    const long resumed = run.progress.startSteps;
+    const double start = wallTime();
     int totParticles = 0;
-    for(int i=0;i<coordPairs*2;i+=2) {
-        for(int j=0;j<amount;j++) {
-            totParticles += walker(i+j, coords[i], coords[i+1], sim_steps);
-        }
+    long particleSteps = 0;
+    if(opts.engine == ENGINE_BATCH) {
+        particleSteps = batchWalk(serial_for(), workerSlot, &hist, coords, coordPairs, amount, sim_steps, cells, radius,
+                                  &frontier, [&](const BatchFrontier* f) { batchPass(serial_for(), &run, f); });
+    } else if(opts.engine == ENGINE_PHILOX) {
+        walkRoots(serial_for(), &run, [&](int lo, int hi) {
+            for(int p=lo;p<hi;p++) {
+                const int e = p / amount;
+                philoxWalker(rootId(e, p % amount), coords[2*e], coords[2*e+1], sim_steps);
+            }
+            return 0;
+        });
+    } else {
+        walkRoots(serial_for(), &run, [&](int lo, int hi) {
+            int particles = 0;
+            for(int p=lo;p<hi;p++) {
+                // the particles of emitter e are seeded 2e+j
+                const int e = p / amount;
+                particles += walker(2*e + p % amount, coords[2*e], coords[2*e+1], sim_steps);
+            }
+            return particles;
+        });
+        totParticles = run.particles;
+    }
+    runEnd(&run);
+    histogramMerge(serial_for(), &hist, outArea);
+    histogramFree(&hist);
+    const double elapsed = wallTime() - start;
+    if(opts.engine != ENGINE_BATCH) {
+        particleSteps = totalSteps(stepCounts, hist.slots);
+    }
+    unsigned int checksum;
+    const int recorded = histogramTotal(radius, outArea, &checksum);
+    if(opts.engine != ENGINE_DRAND48) {
+        totParticles = recorded;
     }
     printf("Walks complete... finished with %d particles\n",totParticles);
+    printf("Histogram holds %d particles, checksum %08x\n",recorded,checksum);
+    printf("%ld particle-steps in %.3f s, %.3g particle-steps/sec\n",particleSteps,elapsed,(particleSteps-resumed)/elapsed);
    
     // Generate the output
-    writeOutput(radius, outArea);
+    writeOutput(serial_for(), radius, outArea, opts.output);
 
     free(coords);
     free(outArea);
+    free(stepCounts);
     free(splitProb);
     free(area);
+    free(cells);
 }
@@ -0,0 +1,135 @@
+#ifndef STARHOLE_SPAWN
+#define STARHOLE_SPAWN
+/*
+ * Spawn cutoff for the task parallel walkers (-s, -d, -A)
+ *
+ * A particle that splits off is walked as a new task only if it has more
+ * than steps steps to go, or if the task it splits from is fewer than depth
+ * spawns from its root; otherwise the walker walks it inline, as the serial
+ * program does. A particle's walk is the same either way, so the cutoff
+ * changes how many tasks there are and never the output.
+ *
+ * -A usec adapts steps while the program runs: every task times the walking
+ * it does itself (its own steps and those of the particles it walks inline,
+ * not the tasks it spawns) into its worker's totals, and every
+ * SPAWN_SAMPLES tasks a worker sets the cutoff to the number of steps that
+ * take usec microseconds at the rate all workers' tasks have walked so far.
+ * Only one worker updates the cutoff at a time, and the others keep walking.
+ * The cutoff and the totals other workers read are atomics, read and written
+ * relaxed: a worker that sees the old cutoff a little longer only spawns or
+ * inlines a few particles differently.
+ */
+#include <stdio.h>
+#include <atomic>
+
+static const int SPAWN_SAMPLES = 64;
+
+// One worker's spawn counts, alone in its cache line. Only the worker writes
+// them; the timed totals are also read by the worker updating the cutoff.
+typedef struct _spawnCount {
+    long spawned;
+    long inlined;
+    std::atomic<long> timedSteps;
+    std::atomic<double> timedSeconds;
+    long tasks;
+    char pad[64 - 3*sizeof(long) - sizeof(std::atomic<long>) - sizeof(std::atomic<double>)];
+} SpawnCount;
+
+typedef struct _spawnPolicy {
+    std::atomic<int> steps;     // spawn children with more steps left than this
+    int depth;                  // or whose parent is fewer spawns from its root than this
+    double adaptSeconds;        // -A target task length, 0 for a fixed cutoff
+    std::atomic<bool> adapting; // a worker is updating steps
+    SpawnCount* counts;
+    int slots;
+} SpawnPolicy;
+
+// A task's time walking, with the time its spawns take left out
+typedef struct _taskClock {
+    double own;
+    double since;
+    long steps;
+} TaskClock;
+
+void spawnInit(SpawnPolicy* p, const SimOptions* opts, int slots) {
+    p->steps.store(opts->spawnSteps, std::memory_order_relaxed);
+    p->depth = opts->spawnDepth;
+    p->adapting.store(false, std::memory_order_relaxed);
+    p->adaptSeconds = opts->spawnAdapt * 1e-6;
+    p->slots = slots;
+    p->counts = (SpawnCount*)callocLines(slots, sizeof(SpawnCount));
+}
+
+void spawnFree(SpawnPolicy* p) {
+    free(p->counts);
+    p->counts = NULL;
+}
+
+// Whether the child split off a task depth spawns deep, with steps to walk, gets a task of its own
+static inline bool spawnChild(SpawnPolicy* p, int slot, int steps, int depth) {
+    if(steps > p->steps.load(std::memory_order_relaxed) || depth < p->depth) {
+        p->counts[slot].spawned++;
+        return true;
+    }
+    p->counts[slot].inlined++;
+    return false;
+}
+
+static inline void taskClockStart(const SpawnPolicy* p, TaskClock* c) {
+    c->own = 0.0;
+    c->steps = 0;
+    c->since = p->adaptSeconds > 0 ? wallTime() : 0.0;
+}
+
+// Around a spawn, so the child's time is not the parent's
+static inline void taskClockPause(const SpawnPolicy* p, TaskClock* c) {
+    if(p->adaptSeconds > 0) {
+        c->own += wallTime() - c->since;
+    }
+}
+
+static inline void taskClockResume(const SpawnPolicy* p, TaskClock* c) {
+    if(p->adaptSeconds > 0) {
+        c->since = wallTime();
+    }
+}
+
+// The task is done; slot must be the calling worker's own
+static inline void taskClockStop(SpawnPolicy* p, int slot, TaskClock* c) {
+    if(p->adaptSeconds <= 0) {
+        return;
+    }
+    taskClockPause(p, c);
+    SpawnCount* s = &p->counts[slot];
+    // only this worker writes its totals, so a load and a store add without a locked instruction
+    s->timedSeconds.store(s->timedSeconds.load(std::memory_order_relaxed) + c->own, std::memory_order_relaxed);
+    s->timedSteps.store(s->timedSteps.load(std::memory_order_relaxed) + c->steps, std::memory_order_relaxed);
+    if(++s->tasks % SPAWN_SAMPLES != 0 || p->adapting.exchange(true, std::memory_order_acquire)) {
+        return;
+    }
+    double seconds = 0.0, steps = 0.0;
+    for(int i=0;i<p->slots;i++) {
+        seconds += p->counts[i].timedSeconds.load(std::memory_order_relaxed);
+        steps += p->counts[i].timedSteps.load(std::memory_order_relaxed);
+    }
+    if(seconds > 0) {
+        const double cutoff = p->adaptSeconds * steps / seconds;
+        p->steps.store(cutoff < 2e9 ? (int)cutoff : 2000000000, std::memory_order_relaxed);
+    }
+    p->adapting.store(false, std::memory_order_release);
+}
+
+void spawnReport(const SpawnPolicy* p) {
+    long spawned = 0, inlined = 0;
+    for(int i=0;i<p->slots;i++) {
+        spawned += p->counts[i].spawned;
+        inlined += p->counts[i].inlined;
+    }
+    printf("Splits: %ld spawned as tasks, %ld walked inline; cutoff %d steps, depth %d",
+           spawned, inlined, p->steps.load(std::memory_order_relaxed), p->depth);
+    if(p->adaptSeconds > 0) {
+        printf(" (adapted to %.0f us tasks)", p->adaptSeconds * 1e6);
+    }
+    printf("\n");
+}
+#endif
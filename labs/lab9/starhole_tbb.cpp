@@ -11,22 +11,72 @@ using namespace cv;
 
 #include "starhole_common.cpp"
 
+// Histogram hooks: a tbb::parallel_for over the range, and a slot handed to
+// each thread the first time it records (the default arena has no thread
+// numbers, but never more than default_num_threads() threads; a thread past
+// that would write past the per-worker arrays, so it stops the run)
+struct tbb_for {
+    template<typename F> void operator()(const int begin, const int end, const F& f) const {
+        tbb::parallel_for(tbb::blocked_range<int>(begin, end), [&](const tbb::blocked_range<int>& r) {
+            f(r.begin(), r.end());
+        });
+    }
+};
+
+static tbb::enumerable_thread_specific<int> tbbSlot(-1);
+static tbb::atomic<int> tbbSlotsTaken;
+
+static int workerSlots() {
+    return tbb::task_scheduler_init::default_num_threads();
+}
+
+static inline int workerSlot() {
+    int& slot = tbbSlot.local();
+    if(slot < 0) {
+        slot = tbbSlotsTaken.fetch_and_increment();
+        if(slot >= workerSlots()) {
+            fprintf(stderr, "Thread %d entered the arena, but the per-worker counts have only %d slots\n",
+                    slot + 1, workerSlots());
+            abort();
+        }
+    }
+    return slot;
+}
+
 // Represents the area in which the particles move
 static DirUpdate*   area;
 
+// Split thresholds and direction tables together, for the counter based engines
+static CellRecord*  cells;
+
 // Holds the split probabilities for Carter particles in cells
 static double*      splitProb;
 
 // Holds final counts of particles in cells
 static int* outArea;
 
+// Per worker counts, merged into outArea after the walks
+static Histogram hist;
+
+// Particle-steps walked per worker
+static StepCount* stepCounts;
+
+// Which splits get tasks of their own
+static SpawnPolicy spawnPolicy;
+
 // Configuration parameters
 static int radius;
 static int sim_steps;
 
+int walkerTask(long int seed, int x, int y, int stepsremaining, int depth);
+void philoxTask(uint64_t id, int x, int y, int stepsremaining, int depth, tbb::task_group& g);
+
 // Returns the total number of particles descending from this call
-// and increments the count at the right location
-int walker(long int seed, int x, int y, int stepsremaining ) {
+// and increments the count at the right location. depth is the number of
+// spawns above the task this walk runs in, and clock times that task.
+int walker(long int seed, int x, int y, int stepsremaining, int depth, TaskClock* clock) {
+    stepCounts[workerSlot()].steps += stepsremaining;
+    clock->steps += stepsremaining;
     struct drand48_data seedbuf;
     srand48_r(seed, &seedbuf);
     
@@ -41,8 +91,14 @@ int walker(long int seed, int x, int y, int stepsremaining ) {
             long int newseed;
             lrand48_r(&seedbuf, &newseed);
             int parts = 0;
-            g.run( [=,&parts]{ parts=walker(seed + newseed, x, y, stepsremaining-1); });
-            g.wait();
+            if(spawnChild(&spawnPolicy, workerSlot(), stepsremaining-1, depth)) {
+                taskClockPause(&spawnPolicy, clock);
+                g.run( [=,&parts]{ parts=walkerTask(seed + newseed, x, y, stepsremaining-1, depth+1); });
+                g.wait();
+                taskClockResume(&spawnPolicy, clock);
+            } else {
+                parts = walker(seed + newseed, x, y, stepsremaining-1, depth, clock);
+            }
             particles.fetch_and_add(parts);
         }
         
@@ -51,15 +107,65 @@ int walker(long int seed, int x, int y, int stepsremaining ) {
     }
     
     // record the final location
-    outArea[toOffset(x,y,radius)] += 1;
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
     
     g.wait();
     return particles;
 }
 
+// Walks a particle as a task of its own
+int walkerTask(long int seed, int x, int y, int stepsremaining, int depth) {
+    TaskClock clock;
+    taskClockStart(&spawnPolicy, &clock);
+    const int particles = walker(seed, x, y, stepsremaining, depth, &clock);
+    taskClockStop(&spawnPolicy, workerSlot(), &clock);
+    return particles;
+}
+
+// Walks particle id and every particle that splits from it, recording
+// their final locations. A child's walk only depends on its id, so it is
+// added to g and left running; the caller waits on g once.
+void philoxWalker(uint64_t id, int x, int y, int stepsremaining, int depth, TaskClock* clock, tbb::task_group& g) {
+    stepCounts[workerSlot()].steps += stepsremaining;
+    clock->steps += stepsremaining;
+    StepBlock block;
+    stepBlockReset(&block);
+    for( ; stepsremaining>0 ; stepsremaining-- ) {
+        const uint64_t bits = stepBits(id, stepsremaining, &block);
+        const CellRecord& c = cells[toOffset(x,y,radius)];
+        if(cellSplits(c, bits)) {
+            const uint64_t child = childId(id, stepsremaining);
+            if(spawnChild(&spawnPolicy, workerSlot(), stepsremaining-1, depth)) {
+                taskClockPause(&spawnPolicy, clock);
+                g.run( [=,&g]{ philoxTask(child, x, y, stepsremaining-1, depth+1, g); });
+                taskClockResume(&spawnPolicy, clock);
+            } else {
+                philoxWalker(child, x, y, stepsremaining-1, depth, clock, g);
+            }
+        }
+        cellMove(c, bits, &x, &y);
+    }
+    histogramAdd(&hist, workerSlot(), toOffset(x,y,radius));
+}
+
+void philoxTask(uint64_t id, int x, int y, int stepsremaining, int depth, tbb::task_group& g) {
+    TaskClock clock;
+    taskClockStart(&spawnPolicy, &clock);
+    philoxWalker(id, x, y, stepsremaining, depth, &clock, g);
+    taskClockStop(&spawnPolicy, workerSlot(), &clock);
+}
+
 int main(int argc, char** argv) {
-    if(argc<6 || ((argc-4)%2 != 0)) {
-        printf("Usage: %s <steps> <radius> <amount> <x1> <y1> ... <xN> <yN>\n",argv[0]);
+    const char* name = argv[0];
+    SimOptions opts;
+    const int first = readOptions(argc, argv, &opts);
+    // readArgs and the count check expect <steps> at argv[1]
+    if(first > 0) {
+        argc -= first - 1;
+        argv += first - 1;
+    }
+    if(first < 0 || argc<6 || ((argc-4)%2 != 0)) {
+        printUsage(name);
         return 1;
     }
 
@@ -70,24 +176,84 @@ int main(int argc, char** argv) {
     readArgs(argc, argv, &sim_steps, &radius, &amount, &coordPairs, &coords);
     
     // Initialize simulation lookups
-    initialize(radius,&outArea,&splitProb,&area);
+    if(opts.engine == ENGINE_DRAND48) {
+        initialize(tbb_for(),radius,&outArea,&splitProb,&area,opts.cacheDir);
+    } else {
+        initializeCells(tbb_for(),radius,&outArea,&cells,opts.cacheDir);
+    }
+    histogramInit(&hist, radius, workerSlots(), opts.histogram);
+    printf("Counting in %s histograms for %d workers\n", histogramModeName(hist.mode), hist.slots);
+    stepCounts = (StepCount*)callocLines(hist.slots, sizeof(StepCount));
+    spawnInit(&spawnPolicy, &opts, hist.slots);
     
     
     // Start initial walks
     printf("Starting the walks...\n");
+    RunControl run;
+    BatchFrontier frontier;
+    if(!runBegin(&run, &opts, opts.engine, radius, sim_steps, amount, coordPairs, coords, outArea, &hist, stepCounts,
+                 &frontier.particleSteps, &frontier.live, &frontier.n)) {
+        return 1;
+    }
+    frontier.nextRoot = run.nextRoot;
+    const long resumed = run.progress.startSteps;
+    const double start = wallTime();
     int totParticles = 0;
-    for(int i=0;i<coordPairs*2;i+=2) {
-        for(int j=0;j<amount;j++) {
-            totParticles += walker(i+j, coords[i], coords[i+1], sim_steps);
-        }
+    long particleSteps = 0;
+    if(opts.engine == ENGINE_BATCH) {
+        particleSteps = batchWalk(tbb_for(), workerSlot, &hist, coords, coordPairs, amount, sim_steps, cells, radius,
+                                  &frontier, [&](const BatchFrontier* f) { batchPass(tbb_for(), &run, f); });
+    } else if(opts.engine == ENGINE_PHILOX) {
+        walkRoots(tbb_for(), &run, [&](int lo, int hi) {
+            tbb::task_group g;
+            tbb::parallel_for(tbb::blocked_range<int>(lo, hi), [&](const tbb::blocked_range<int>& range) {
+                for(int p=range.begin();p!=range.end();p++) {
+                    const int e = p / amount;
+                    philoxTask(rootId(e, p % amount), coords[2*e], coords[2*e+1], sim_steps, 0, g);
+                }
+            });
+            g.wait();
+            return 0;
+        });
+    } else {
+        walkRoots(tbb_for(), &run, [&](int lo, int hi) {
+            int particles = 0;
+            for(int p=lo;p<hi;p++) {
+                // the particles of emitter e are seeded 2e+j
+                const int e = p / amount;
+                particles += walkerTask(2*e + p % amount, coords[2*e], coords[2*e+1], sim_steps, 0);
+            }
+            return particles;
+        });
+        totParticles = run.particles;
+    }
+    runEnd(&run);
+    histogramMerge(tbb_for(), &hist, outArea);
+    histogramFree(&hist);
+    const double elapsed = wallTime() - start;
+    if(opts.engine != ENGINE_BATCH) {
+        particleSteps = totalSteps(stepCounts, hist.slots);
+    }
+    unsigned int checksum;
+    const int recorded = histogramTotal(radius, outArea, &checksum);
+    if(opts.engine != ENGINE_DRAND48) {
+        totParticles = recorded;
     }
     printf("Walks complete... finished with %d particles\n",totParticles);
+    printf("Histogram holds %d particles, checksum %08x\n",recorded,checksum);
+    printf("%ld particle-steps in %.3f s, %.3g particle-steps/sec\n",particleSteps,elapsed,(particleSteps-resumed)/elapsed);
+    if(opts.engine != ENGINE_BATCH) {
+        spawnReport(&spawnPolicy);
+    }
    
     // Generate the output
-    writeOutput(radius, outArea);
+    writeOutput(tbb_for(), radius, outArea, opts.output);
 
     free(coords);
     free(outArea);
+    free(stepCounts);
+    spawnFree(&spawnPolicy);
     free(splitProb);
     free(area);
+    free(cells);
 }